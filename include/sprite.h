@@ -1,8 +1,13 @@
 #ifndef SPRITE_H_INCLUDED
 #define SPRITE_H_INCLUDED
 
+#include <stddef.h>
 #include <stdint.h>
 
+// Flip flags stored per tile map entry, matching the OAM attribute bits
+#define TILE_FLIP_X 0x20
+#define TILE_FLIP_Y 0x40
+
 struct sprite_t
 {
     uint8_t width;
@@ -12,10 +17,90 @@ struct sprite_t
     uint16_t *image;
 };
 
+enum sprite_plane_t
+{
+    SPRITE_PLANE_MASK,
+    SPRITE_PLANE_LOW,
+    SPRITE_PLANE_HIGH
+};
+
+// 1bpp image at the sprite's native size, stored as columns of bytes 8 pixels wide
+struct sprite_mask_t
+{
+    uint8_t width;
+    uint8_t height;
+    uint8_t *data;
+};
+
+// Bounds and column bits are in pixels relative to the sprite's native size, not the 7x7 tile frame
+struct sprite_query_t
+{
+    uint8_t width;
+    uint8_t height;
+    uint8_t bounds_x;
+    uint8_t bounds_y;
+    uint8_t bounds_width;
+    uint8_t bounds_height;
+    uint64_t occupied_columns;
+    uint32_t histogram[4];
+};
+
+struct tile_set_t
+{
+    uint8_t *tiles;
+    uint8_t *tile_attributes;
+    uint16_t *hash_index;
+    size_t tile_count;
+    size_t tile_capacity;
+    size_t hash_capacity;
+    size_t tiles_added;
+    size_t flip_matches;
+    uint8_t flip_dedup;
+};
+
+struct tile_map_t
+{
+    uint8_t width;
+    uint8_t height;
+    uint16_t *indices;
+    uint8_t *attributes;
+};
+
+struct tile_set_stats_t
+{
+    size_t tiles_added;
+    size_t unique_tiles;
+    size_t flip_matches;
+    size_t bytes_in;
+    size_t bytes_out;
+    double dedup_ratio;
+};
+
 struct sprite_t load_sprite(const char *const filename);
+struct sprite_t decode_sprite(const uint8_t *const data, const size_t size);
+void decode_sprite_batch(const uint8_t *const *const data, const size_t *const sizes, const size_t count, struct sprite_t *const sprites);
 void save_sprite(const struct sprite_t *const v_sprite, const uint8_t encoding_method, const uint8_t primary_buffer, const char *const filename);
 void free_sprite(struct sprite_t *const sprite);
 
+struct sprite_mask_t load_sprite_plane(const char *const filename, const enum sprite_plane_t plane);
+struct sprite_mask_t decode_sprite_plane_data(const uint8_t *const data, const size_t size, const enum sprite_plane_t plane);
+void free_sprite_mask(struct sprite_mask_t *const mask);
+
+struct sprite_query_t query_sprite(const char *const filename);
+struct sprite_query_t query_sprite_data(const uint8_t *const data, const size_t size);
+// Column queries return 1 if the sprite decoded, 0 on error with the output cleared
+uint8_t get_occupied_columns(const char *const filename, const uint8_t column_count, uint64_t *const occupied_columns);
+uint8_t get_occupied_columns_data(const uint8_t *const data, const size_t size, const uint8_t column_count, uint64_t *const occupied_columns);
+uint8_t is_sprite_column_empty(const char *const filename, const uint8_t column, uint8_t *const empty);
+uint8_t is_sprite_column_empty_data(const uint8_t *const data, const size_t size, const uint8_t column, uint8_t *const empty);
+
+struct tile_set_t create_tile_set(const uint8_t flip_dedup);
+struct tile_map_t add_sprite_to_tile_set(struct tile_set_t *const tile_set, const struct sprite_t *const sprite);
+struct sprite_t tile_map_to_sprite(const struct tile_set_t *const tile_set, const struct tile_map_t *const tile_map);
+struct tile_set_stats_t get_tile_set_stats(const struct tile_set_t *const tile_set);
+void free_tile_map(struct tile_map_t *const tile_map);
+void free_tile_set(struct tile_set_t *const tile_set);
+
 void export_sprite_to_ppm(const struct sprite_t *const sprite, const char *const filename);
 
 #endif // SPRITE_H_INCLUDED
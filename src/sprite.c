@@ -5,6 +5,19 @@
 #include <string.h>
 #include <stdio.h>
 
+#if defined(__x86_64__) || defined(_M_X64)
+ #define SPRITE_BATCH_SIMD
+ #include <immintrin.h>
+ #if defined(_MSC_VER) && !defined(__clang__)
+  #include <intrin.h>
+  #define TARGET_AVX2
+  #define TARGET_AVX512
+ #else
+  #define TARGET_AVX2 __attribute__((target("avx2")))
+  #define TARGET_AVX512 __attribute__((target("avx512f,avx512cd,avx512bw")))
+ #endif
+#endif
+
 // Buffer settings for bitplane using 8x8 pixel tiles @ 1 bit per pixel
 #define PX_PER_BYTE 8
 #define BUFFER_WIDTH_IN_TILES 7
@@ -12,8 +25,21 @@
 #define TILE_WIDTH 1
 #define TILE_HEIGHT 8
 #define BUFFER_SIZE (BUFFER_WIDTH_IN_TILES * TILE_WIDTH * BUFFER_HEIGHT_IN_TILES * TILE_HEIGHT)
+#define BUFFER_WIDTH_IN_PX (BUFFER_WIDTH_IN_TILES * TILE_WIDTH * PX_PER_BYTE)
 #define RLE_MASK 0x0000000000000001
 
+// Batch decoding, one sprite per SIMD lane
+#define SPRITE_BATCH_LANES 16
+#define SPRITE_STREAM_LIMIT (BUFFER_SIZE * 4)
+#define SPRITE_BATCH_STREAM_SIZE (SPRITE_STREAM_LIMIT * SPRITE_BATCH_LANES + 8)
+#define SPRITE_BATCH_LANE_SIZE (BUFFER_SIZE * 2 + BUFFER_SIZE * (PX_PER_BYTE >> 1) + 1)
+#define RLE_MAX_COUNT_BITS 12
+
+// Native Gameboy tile: 8 rows of 2 bytes, low bitplane first
+#define GB_TILE_SIZE 16
+#define TILE_HASH_EMPTY 0
+#define TILE_HASH_INITIAL_CAPACITY 64
+
 #if defined(DEBUG) && DEBUG > 0
  #define DEBUG_PRINT(fmt, ...) fprintf(stdout, "DEBUG: %s:%d:%s(): " fmt, __FILE__, __LINE__, __func__, ##__VA_ARGS__)
 #else
@@ -42,6 +68,15 @@ struct bit_buffer_t
     int8_t bit_index;
 };
 
+// Decoded bitplanes stored as one row mask per pixel column, bit n set for row n
+struct column_planes_t
+{
+    uint8_t width;
+    uint8_t height;
+    uint64_t low[BUFFER_WIDTH_IN_PX];
+    uint64_t high[BUFFER_WIDTH_IN_PX];
+};
+
 void export_bitplane_to_ppm(const uint8_t *const data, const uint8_t width_in_tiles, const uint8_t height_in_tiles, const char *const filename)
 {
     FILE *fp = fopen(filename, "wb");
@@ -178,6 +213,58 @@ void diff_encode_buffer(const uint8_t width_in_tiles, const uint8_t height_in_ti
     }
 }
 
+static enum rle_error_t read_run_length(struct bit_buffer_t *const inputstream, uint64_t *const run)
+{
+    uint64_t L = 0;
+    uint64_t V = 0;
+    uint8_t bit_count = 0;
+
+    do
+    {
+        L <<= 1;
+        L |= (inputstream->data[inputstream->byte_index] >> inputstream->bit_index) & RLE_MASK;
+        advance_bit_index(inputstream, 1);
+        bit_count++;
+    }
+    while ((L & RLE_MASK) && (inputstream->byte_index < inputstream->size));
+
+    while (bit_count && (inputstream->byte_index < inputstream->size))
+    {
+        V <<= 1;
+        V |= (inputstream->data[inputstream->byte_index] >> inputstream->bit_index) & RLE_MASK;
+        advance_bit_index(inputstream, 1);
+        bit_count--;
+    }
+
+    if(bit_count)
+    {
+        fprintf(stderr, "Incomplete RUN data\n");
+        return RUN_EOF;
+    }
+
+    *run = L + V + 1;
+    return NO_ERROR;
+}
+
+static enum rle_error_t read_bit_pair(struct bit_buffer_t *const inputstream, uint8_t *const bit_pair)
+{
+    if (inputstream->bit_index == 0)
+    {
+        if ((inputstream->byte_index + 1) >= inputstream->size)
+        {
+            fprintf(stderr, "Incomplete DATA\n");
+            return DATA_EOF;
+        }
+        *bit_pair = ((inputstream->data[inputstream->byte_index] << 1) & 0x02) | (inputstream->data[inputstream->byte_index + 1] >> 7);
+    }
+    else
+    {
+        *bit_pair = (inputstream->data[inputstream->byte_index] >> (inputstream->bit_index - 1)) & 0x03;
+    }
+    advance_bit_index(inputstream, 2);
+    return NO_ERROR;
+}
+
 enum rle_error_t rle_decode(struct bit_buffer_t *const inputstream, const uint8_t width_in_tiles, const uint8_t height_in_tiles, uint8_t *const output_buffer)
 {
     uint16_t bitplane_size = width_in_tiles * TILE_WIDTH * height_in_tiles * TILE_HEIGHT * PX_PER_BYTE;
@@ -196,40 +283,18 @@ enum rle_error_t rle_decode(struct bit_buffer_t *const inputstream, const uint8_
     uint8_t y = 0;
     int8_t shift = 6;
 
-    memset(output_buffer, 0, BUFFER_SIZE);
+    memset(output_buffer, 0, bitplane_size / PX_PER_BYTE);
 
     while (bits_read < bitplane_size)
     {
         if (packet_type == RUN)
         {
-            uint64_t L = 0;
-            uint64_t V = 0;
-            uint8_t bit_count = 0;
-
-            do
-            {
-                L <<= 1;
-                L |= (inputstream->data[inputstream->byte_index] >> inputstream->bit_index) & RLE_MASK;
-                advance_bit_index(inputstream, 1);
-                bit_count++;
-            }
-            while ((L & RLE_MASK) && (inputstream->byte_index < inputstream->size));
-
-            while (bit_count && (inputstream->byte_index < inputstream->size))
+            uint64_t N;
+            if (read_run_length(inputstream, &N) != NO_ERROR)
             {
-                V <<= 1;
-                V |= (inputstream->data[inputstream->byte_index] >> inputstream->bit_index) & RLE_MASK;
-                advance_bit_index(inputstream, 1);
-                bit_count--;
-            }
-
-            if(bit_count)
-            {
-                fprintf(stderr, "Incomplete RUN data\n");
                 return RUN_EOF;
             }
 
-            uint64_t N = L + V + 1;
             bits_read += N << 1;
 
             if (bits_read > bitplane_size)
@@ -248,21 +313,10 @@ enum rle_error_t rle_decode(struct bit_buffer_t *const inputstream, const uint8_
         else
         {
             uint8_t bit_pair;
-
-            if (inputstream->bit_index == 0)
+            if (read_bit_pair(inputstream, &bit_pair) != NO_ERROR)
             {
-                if ((inputstream->byte_index + 1) >= inputstream->size)
-                {
-                    fprintf(stderr, "Incomplete DATA\n");
-                    return DATA_EOF;
-                }
-                bit_pair = ((inputstream->data[inputstream->byte_index] << 1) & 0x02) | (inputstream->data[inputstream->byte_index + 1] >> 7);
-            }
-            else
-            {
-                bit_pair = (inputstream->data[inputstream->byte_index] >> (inputstream->bit_index - 1)) & 0x03;
+                return DATA_EOF;
             }
-            advance_bit_index(inputstream, 2);
 
             if (bit_pair)
             {
@@ -289,6 +343,76 @@ enum rle_error_t rle_decode(struct bit_buffer_t *const inputstream, const uint8_
     return NO_ERROR;
 }
 
+enum rle_error_t rle_decode_columns(struct bit_buffer_t *const inputstream, const uint8_t width_in_tiles, const uint8_t height_in_tiles, const uint8_t column_count, uint64_t *const columns)
+{
+    // Only DATA packets touch the output, RUN packets just move the position. Stops once column_count pixel
+    // columns are complete, leaving the stream mid-plane.
+    uint8_t rows = height_in_tiles * TILE_HEIGHT;
+    uint16_t plane_pairs = width_in_tiles * TILE_WIDTH * (PX_PER_BYTE >> 1) * rows;
+    uint16_t target_pairs = ((column_count + 1) >> 1) * rows;
+    uint16_t pairs_read = 0;
+
+    enum rle_data_t packet_type = (inputstream->data[inputstream->byte_index] >> inputstream->bit_index) & 0x01;
+    advance_bit_index(inputstream, 1);
+
+    if (inputstream->byte_index == inputstream->size)
+    {
+        fprintf(stderr, "Packet type occurs at end of data stream\n");
+        return UNEXPECTED_EOF;
+    }
+
+    uint8_t column = 0;
+    uint8_t row = 0;
+
+    while (pairs_read < target_pairs)
+    {
+        if (packet_type == RUN)
+        {
+            uint64_t N;
+            if (read_run_length(inputstream, &N) != NO_ERROR)
+            {
+                return RUN_EOF;
+            }
+            if (pairs_read + N > plane_pairs)
+            {
+                fprintf(stderr, "RUN data out of bounds\n");
+                return RUN_EOF;
+            }
+            pairs_read += N;
+            column = (pairs_read / rows) << 1;
+            row = pairs_read % rows;
+
+            packet_type = DATA;
+        }
+        else
+        {
+            uint8_t bit_pair;
+            if (read_bit_pair(inputstream, &bit_pair) != NO_ERROR)
+            {
+                return DATA_EOF;
+            }
+
+            if (bit_pair)
+            {
+                columns[column] |= (uint64_t)(bit_pair >> 1) << row;
+                columns[column + 1] |= (uint64_t)(bit_pair & 0x01) << row;
+                row++;
+                if (row >= rows)
+                {
+                    row = 0;
+                    column += 2;
+                }
+                pairs_read++;
+            }
+            else
+            {
+                packet_type = RUN;
+            }
+        }
+    }
+    return NO_ERROR;
+}
+
 void rle_encode(const uint8_t *const image, const uint8_t width_in_tiles, const uint8_t height_in_tiles, struct bit_buffer_t *const outputstream)
 {
     uint8_t initial_packet = (*image & 0xC0) != 0x00;
@@ -402,180 +526,1332 @@ void remove_sprite_offset(uint8_t *const buffer, const uint8_t buffer_width, con
     }
 }
 
-struct sprite_t load_sprite(const char *const filename)
+static uint8_t *read_sprite_file(const char *const filename, size_t *const filesize)
 {
-    struct sprite_t v_sprite = { .width=0, .height=0, .image=NULL };
     FILE *fp = fopen(filename, "rb");
     if(fp == NULL)
     {
         fprintf(stderr, "Unable to load file [%s]\n", filename);
-        return v_sprite;
+        return NULL;
     }
     fseek(fp, 0L, SEEK_END);
-    size_t filesize = ftell(fp);
-    uint8_t *input = malloc(filesize);
+    *filesize = ftell(fp);
+    uint8_t *input = malloc(*filesize);
     fseek(fp, 0L, SEEK_SET);
-    size_t bytes_read = fread(input, sizeof(uint8_t), filesize, fp);
+    size_t bytes_read = fread(input, sizeof(uint8_t), *filesize, fp);
     if(ferror(fp))
     {
         fprintf(stderr, "File read failed\n");
-        return v_sprite;
+        fclose(fp);
+        free(input);
+        return NULL;
     }
-    if(bytes_read < filesize)
+    if(bytes_read < *filesize)
     {
         fprintf(stderr, "Failed to read all file contents\n");
-        return v_sprite;
+        fclose(fp);
+        free(input);
+        return NULL;
     }
     if(feof(fp))
     {
         DEBUG_PRINT("%s", "End of file reached successfully\n");
     }
     fclose(fp);
+    return input;
+}
 
-    uint8_t *buffer = calloc(BUFFER_SIZE * 3, sizeof(uint8_t));
-    uint8_t *BUF_A = buffer;
-    uint8_t *BUF_B = buffer + BUFFER_SIZE;
-    uint8_t *BUF_C = buffer + 2 * BUFFER_SIZE;
+static uint8_t read_encoding_method(struct bit_buffer_t *const bit_ptr)
+{
+    uint8_t encoding_method = (bit_ptr->data[bit_ptr->byte_index] >> bit_ptr->bit_index) & 0x01;
+    advance_bit_index(bit_ptr, 1);
+
+    if (encoding_method != 0)
+    {
+        encoding_method = (encoding_method << 1) | ((bit_ptr->data[bit_ptr->byte_index] >> bit_ptr->bit_index) & 0x01);
+        advance_bit_index(bit_ptr, 1);
+    }
+    return encoding_method;
+}
+
+static uint8_t valid_sprite_header(const uint8_t *const input, const size_t filesize)
+{
+    if (filesize < 2)
+    {
+        fprintf(stderr, "Sprite header truncated\n");
+        return 0;
+    }
+    uint8_t width = input[0] >> 4;
+    uint8_t height = input[0] & 0x0f;
+    if (width == 0 || width > BUFFER_WIDTH_IN_TILES || height == 0 || height > BUFFER_HEIGHT_IN_TILES)
+    {
+        fprintf(stderr, "Invalid sprite size %ux%u\n", width, height);
+        return 0;
+    }
+    return 1;
+}
+
+static void diff_decode_rows(const uint8_t width_in_tiles, const uint8_t height_in_tiles, uint8_t *const buffer)
+{
+    // Same result as diff_decode_buffer, but each byte is prefix XORed in three shifts and the carry between
+    // bytes is kept per row, so the inner loop has no dependency from one row to the next.
+    uint8_t rows = height_in_tiles * TILE_HEIGHT;
+    uint8_t carry[BUFFER_HEIGHT_IN_TILES * TILE_HEIGHT] = {0};
+    for (uint8_t x = 0; x < width_in_tiles * TILE_WIDTH; x++)
+    {
+        uint8_t *column = buffer + x * rows;
+        for (uint8_t y = 0; y < rows; y++)
+        {
+            uint8_t temp = column[y];
+            temp ^= temp >> 1;
+            temp ^= temp >> 2;
+            temp ^= temp >> 4;
+            temp ^= carry[y];
+            column[y] = temp;
+            carry[y] = (temp & 0x01) ? 0xff : 0x00;
+        }
+    }
+}
+
+static void interleave_sprite_image(struct sprite_t *const v_sprite, const uint8_t *const low_plane, const uint8_t *const high_plane)
+{
+    // Interleaves straight into the image at the sprite offset, so only the sprite's own columns are touched
+    uint8_t rows = v_sprite->height * TILE_HEIGHT;
+    size_t width_offset_in_tiles = (BUFFER_WIDTH_IN_TILES - v_sprite->width + 1) >> 1;
+    size_t height_offset_in_tiles = BUFFER_HEIGHT_IN_TILES - v_sprite->height;
+    size_t index = (width_offset_in_tiles * BUFFER_HEIGHT_IN_TILES + height_offset_in_tiles) * TILE_HEIGHT;
+
+    v_sprite->image = calloc(BUFFER_SIZE, sizeof(uint16_t));
+    for (uint8_t c = 0; c < v_sprite->width * TILE_WIDTH; c++)
+    {
+        interleave_bitplanes(low_plane + c * rows, high_plane + c * rows, rows, v_sprite->image + index);
+        index += BUFFER_HEIGHT_IN_TILES * TILE_HEIGHT;
+    }
+}
+
+static void finish_sprites(struct sprite_t *const sprites, uint8_t *const *const BP0, uint8_t *const *const BP1, const uint8_t count, const uint32_t valid)
+{
+    // Runs each post-processing stage across every sprite before starting the next
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (valid & (1 << i))
+        {
+            diff_decode_rows(sprites[i].width, sprites[i].height, BP0[i]);
+            if (sprites[i].encoding_method != 2)
+            {
+                diff_decode_rows(sprites[i].width, sprites[i].height, BP1[i]);
+            }
+        }
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if ((valid & (1 << i)) && sprites[i].encoding_method > 1)
+        {
+            size_t image_size = sprites[i].width * TILE_WIDTH * sprites[i].height * TILE_HEIGHT;
+            for (size_t j = 0; j < image_size; j++)
+            {
+                BP1[i][j] ^= BP0[i][j];
+            }
+        }
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (valid & (1 << i))
+        {
+            const uint8_t *low_plane = (sprites[i].primary_buffer) ? BP1[i] : BP0[i];
+            const uint8_t *high_plane = (sprites[i].primary_buffer) ? BP0[i] : BP1[i];
+            interleave_sprite_image(&sprites[i], low_plane, high_plane);
+        }
+        else
+        {
+            free_sprite(&sprites[i]);
+        }
+    }
+}
+
+struct sprite_t decode_sprite(const uint8_t *const data, const size_t size)
+{
+    struct sprite_t v_sprite = { .width=0, .height=0, .image=NULL };
+    if (!valid_sprite_header(data, size))
+    {
+        return v_sprite;
+    }
+
+    uint8_t *buffer = malloc(BUFFER_SIZE * 2);
     uint8_t *BP0;
     uint8_t *BP1;
 
-    v_sprite.width = input[0] >> 4;
-    v_sprite.height = input[0] & 0x0f;
-    v_sprite.primary_buffer = input[1] >> 7;
-    size_t image_size = v_sprite.width * TILE_WIDTH * v_sprite.height * TILE_HEIGHT;
+    v_sprite.width = data[0] >> 4;
+    v_sprite.height = data[0] & 0x0f;
+    v_sprite.primary_buffer = data[1] >> 7;
     struct bit_buffer_t bit_ptr =
     {
-        .data = input,
-        .size = filesize,
+        .data = (uint8_t *)data,
+        .size = size,
         .byte_index = 1,
         .bit_index = 6
     };
 
     if (v_sprite.primary_buffer == 0)
     {
-        BP0 = BUF_B;
-        BP1 = BUF_C;
+        BP0 = buffer;
+        BP1 = buffer + BUFFER_SIZE;
     }
     else
     {
-        BP0 = BUF_C;
-        BP1 = BUF_B;
+        BP0 = buffer + BUFFER_SIZE;
+        BP1 = buffer;
     }
 
     DEBUG_PRINT("Decoding %ux%u tile sprite.\n", v_sprite.width, v_sprite.height);
     DEBUG_PRINT("Primary buffer: %u\n", v_sprite.primary_buffer);
     if (rle_decode(&bit_ptr, v_sprite.width, v_sprite.height, BP0) != NO_ERROR)
     {
+        free(buffer);
         free_sprite(&v_sprite);
         return v_sprite;
     }
-    v_sprite.encoding_method = (bit_ptr.data[bit_ptr.byte_index] >> bit_ptr.bit_index) & 0x01;
-    advance_bit_index(&bit_ptr, 1);
-
-    if (v_sprite.encoding_method != 0)
-    {
-        v_sprite.encoding_method = (v_sprite.encoding_method << 1) | ((bit_ptr.data[bit_ptr.byte_index] >> bit_ptr.bit_index) & 0x01);
-        advance_bit_index(&bit_ptr, 1);
-    }
+    v_sprite.encoding_method = read_encoding_method(&bit_ptr);
     DEBUG_PRINT("Encoding mode: %u\n", v_sprite.encoding_method);
 
     if (rle_decode(&bit_ptr, v_sprite.width, v_sprite.height, BP1) != NO_ERROR)
     {
+        free(buffer);
         free_sprite(&v_sprite);
         return v_sprite;
     }
 
-    diff_decode_buffer(v_sprite.width, v_sprite.height, BP0);
-    if (v_sprite.encoding_method != 2)
-    {
-        diff_decode_buffer(v_sprite.width, v_sprite.height, BP1);
-    }
-    if (v_sprite.encoding_method > 1)
-    {
-        for (size_t i = 0; i < image_size; i++)
-        {
-            BP1[i] = BP1[i] ^ BP0[i];
-        }
-    }
+    finish_sprites(&v_sprite, &BP0, &BP1, 1, 0x01);
+    free(buffer);
 
-    apply_sprite_offset(BUF_B, BUFFER_WIDTH_IN_TILES, BUFFER_HEIGHT_IN_TILES, BUF_A, v_sprite.width, v_sprite.height);
-    memset(BUF_B, 0, BUFFER_SIZE);
-    apply_sprite_offset(BUF_C, BUFFER_WIDTH_IN_TILES, BUFFER_HEIGHT_IN_TILES, BUF_B, v_sprite.width, v_sprite.height);
+    return v_sprite;
+}
 
-    interleave_bitplanes(BUF_A, BUF_B, BUFFER_SIZE, (uint16_t *)BUF_B);
-    v_sprite.image = (uint16_t *)malloc(BUFFER_SIZE << 1);
-    memcpy(v_sprite.image, BUF_B, BUFFER_SIZE << 1);
+struct sprite_t load_sprite(const char *const filename)
+{
+    struct sprite_t v_sprite = { .width=0, .height=0, .image=NULL };
+    size_t filesize;
+    uint8_t *input = read_sprite_file(filename, &filesize);
+    if (input == NULL)
+    {
+        return v_sprite;
+    }
 
+    v_sprite = decode_sprite(input, filesize);
     free(input);
-    free(buffer);
 
     return v_sprite;
 }
 
-void save_sprite(const struct sprite_t *const v_sprite, const uint8_t encoding_method, const uint8_t primary_buffer, const char *const filename)
+#if defined(SPRITE_BATCH_SIMD)
+
+enum batch_isa_t
 {
-    uint8_t *buffer = calloc(BUFFER_SIZE * 3, sizeof(uint8_t));
-    uint8_t *BUF_A = buffer;
-    uint8_t *BUF_B = buffer + BUFFER_SIZE;
-    uint8_t *BUF_C = buffer + 2 * BUFFER_SIZE;
-    uint8_t *BP0 = (primary_buffer) ? BUF_C : BUF_B;
-    uint8_t *BP1 = (primary_buffer) ? BUF_B : BUF_C;
+    BATCH_SCALAR,
+    BATCH_AVX2,
+    BATCH_AVX512
+};
 
-    separate_bitplanes(v_sprite->image, BUFFER_SIZE, BUF_A, BUF_B);
-    remove_sprite_offset(BUF_B, BUFFER_WIDTH_IN_TILES, BUFFER_HEIGHT_IN_TILES, BUF_C, v_sprite->width, v_sprite->height);
-    remove_sprite_offset(BUF_A, BUFFER_WIDTH_IN_TILES, BUFFER_HEIGHT_IN_TILES, BUF_B, v_sprite->width, v_sprite->height);
+// Lane state for decoding one bitplane of each sprite in a batch. Positions are bit offsets into the shared
+// stream, counting from the most significant bit of each byte.
+struct rle_lanes_t
+{
+    const uint8_t *stream;
+    int32_t position[SPRITE_BATCH_LANES];
+    int32_t end[SPRITE_BATCH_LANES];
+    int32_t plane_pairs[SPRITE_BATCH_LANES];
+    uint8_t *pairs[SPRITE_BATCH_LANES];
+    uint32_t valid;
+};
 
-    if (encoding_method > 1)
+struct batch_order_t
+{
+    size_t size;
+    size_t index;
+};
+
+static enum batch_isa_t detect_batch_isa(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
     {
-        for (size_t i = 0; i < v_sprite->width * TILE_WIDTH * v_sprite->height * TILE_HEIGHT; i++)
-        {
-            BP1[i] = BP0[i] ^ BP1[i];
-        }
+        return BATCH_SCALAR;
     }
-    if (encoding_method != 2)
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 0x06) != 0x06)
     {
-        diff_encode_buffer(v_sprite->width, v_sprite->height, BP1);
+        return BATCH_SCALAR;
     }
-    diff_encode_buffer(v_sprite->width, v_sprite->height, BP0);
+    __cpuidex(info, 7, 0);
+    if ((info[1] & (1 << 16)) && (info[1] & (1 << 28)) && (info[1] & (1 << 30)) && (_xgetbv(0) & 0xe6) == 0xe6)
+    {
+        return BATCH_AVX512;
+    }
+    if (info[1] & (1 << 5))
+    {
+        return BATCH_AVX2;
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512bw"))
+    {
+        return BATCH_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return BATCH_AVX2;
+    }
+#endif
+    return BATCH_SCALAR;
+}
 
-    struct bit_buffer_t compressedImage =
+static enum batch_isa_t limit_batch_isa(const enum batch_isa_t isa)
+{
+    // GB_SPRITE_BATCH_ISA caps the kernel, so the ones a newer CPU would skip can still be tested
+    const char *const limit = getenv("GB_SPRITE_BATCH_ISA");
+    if (limit == NULL)
     {
-        .data = calloc(BUFFER_SIZE * 2, sizeof(uint8_t)),
-        .size = BUFFER_SIZE * 2
-    };
+        return isa;
+    }
+    if (strcmp(limit, "scalar") == 0)
+    {
+        return BATCH_SCALAR;
+    }
+    if (strcmp(limit, "avx2") == 0 && isa > BATCH_AVX2)
+    {
+        return BATCH_AVX2;
+    }
+    return isa;
+}
 
-    compressedImage.data[0] = v_sprite->width << 4 | v_sprite->height;
-    compressedImage.data[1] = primary_buffer << 7;
-    compressedImage.byte_index = 1;
-    compressedImage.bit_index = 6;
+TARGET_AVX2 static __m256i read_window_avx2(const uint8_t *const stream, const __m256i position)
+{
+    // Loads the 32 bits starting at each lane's position, first bit in the sign bit
+    const __m256i byte_swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i window = _mm256_i32gather_epi32((const int *)stream, _mm256_srli_epi32(position, 3), 1);
+    window = _mm256_shuffle_epi8(window, byte_swap);
+    return _mm256_sllv_epi32(window, _mm256_and_si256(position, _mm256_set1_epi32(0x07)));
+}
 
-    rle_encode(BP0, v_sprite->width, v_sprite->height, &compressedImage);
-    int16_t count = (encoding_method == 0) ? 1 : 2;
-    write_buffer(encoding_method, count, &compressedImage);
-    rle_encode(BP1, v_sprite->width, v_sprite->height, &compressedImage);
+TARGET_AVX2 static __m256i leading_zeros_avx2(const __m256i value)
+{
+    // Exact for the top 24 bits through the float exponent, lanes with fewer leading zeros are all that matter
+    __m256 top = _mm256_cvtepi32_ps(_mm256_srli_epi32(value, 8));
+    __m256i exponent = _mm256_srli_epi32(_mm256_castps_si256(top), 23);
+    return _mm256_sub_epi32(_mm256_set1_epi32(127 + 23), exponent);
+}
 
-    if (compressedImage.bit_index != 7)
+TARGET_AVX2 static void rle_decode_lanes_avx2(struct rle_lanes_t *const lanes, const uint8_t first_lane)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    const __m256i all_ones = _mm256_set1_epi32(-1);
+    const __m256i max_count = _mm256_set1_epi32(RLE_MAX_COUNT_BITS);
+    const __m256i lane_bits = _mm256_setr_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    int32_t pair_values[8];
+    int32_t pair_index[8];
+
+    __m256i position = _mm256_loadu_si256((const __m256i *)(lanes->position + first_lane));
+    __m256i end = _mm256_loadu_si256((const __m256i *)(lanes->end + first_lane));
+    __m256i plane_pairs = _mm256_loadu_si256((const __m256i *)(lanes->plane_pairs + first_lane));
+    __m256i pairs_read = zero;
+    __m256i valid = _mm256_set1_epi32((lanes->valid >> first_lane) & 0xff);
+    __m256i active = _mm256_cmpeq_epi32(_mm256_and_si256(valid, lane_bits), lane_bits);
+
+    __m256i data_packet = _mm256_srai_epi32(read_window_avx2(lanes->stream, position), 31);
+    position = _mm256_add_epi32(position, one);
+    __m256i failed = _mm256_andnot_si256(_mm256_cmpgt_epi32(end, position), active);
+    active = _mm256_andnot_si256(failed, active);
+
+    while (_mm256_movemask_ps(_mm256_castsi256_ps(active)))
     {
-        compressedImage.byte_index++;
-    }
+        __m256i window = read_window_avx2(lanes->stream, position);
+
+        // DATA lanes take a pixel pair, a 00 pair switches them to RUN
+        __m256i pair = _mm256_srli_epi32(window, 30);
+        __m256i pair_zero = _mm256_cmpeq_epi32(pair, zero);
+        __m256i data_lanes = _mm256_and_si256(active, data_packet);
+        __m256i store = _mm256_andnot_si256(pair_zero, data_lanes);
+
+        // RUN lanes read L as a string of ones ending in a zero, then V with as many bits
+        __m256i run_lanes = _mm256_andnot_si256(data_packet, active);
+        __m256i count = _mm256_add_epi32(leading_zeros_avx2(_mm256_xor_si256(window, all_ones)), one);
+        __m256i length = _mm256_sub_epi32(_mm256_sllv_epi32(one, count), two);
+        __m256i value = _mm256_srlv_epi32(_mm256_sllv_epi32(window, count), _mm256_sub_epi32(_mm256_set1_epi32(32), count));
+        __m256i run = _mm256_add_epi32(_mm256_add_epi32(length, value), one);
+
+        // Every lane writes, zero unless it has a pair. The next pair or a run of zeros lands there anyway.
+        _mm256_storeu_si256((__m256i *)pair_values, _mm256_and_si256(store, pair));
+        _mm256_storeu_si256((__m256i *)pair_index, _mm256_min_epi32(pairs_read, plane_pairs));
+        for (uint8_t lane = 0; lane < 8; lane++)
+        {
+            lanes->pairs[first_lane + lane][pair_index[lane]] = pair_values[lane];
+        }
 
-    FILE *fp = fopen(filename, "wb");
-    if(fp == NULL)
-    {
-        fprintf(stderr, "Unable to open file [%s] for writing\n", filename);
-        return;
+        __m256i step = _mm256_or_si256(_mm256_and_si256(data_lanes, two), _mm256_and_si256(run_lanes, _mm256_slli_epi32(count, 1)));
+        position = _mm256_add_epi32(position, step);
+        pairs_read = _mm256_add_epi32(pairs_read, _mm256_and_si256(store, one));
+        pairs_read = _mm256_add_epi32(pairs_read, _mm256_and_si256(run_lanes, run));
+        data_packet = _mm256_xor_si256(data_packet, _mm256_or_si256(_mm256_and_si256(data_lanes, pair_zero), run_lanes));
+
+        __m256i lane_failed = _mm256_or_si256(_mm256_cmpgt_epi32(position, end), _mm256_cmpgt_epi32(pairs_read, plane_pairs));
+        lane_failed = _mm256_or_si256(lane_failed, _mm256_and_si256(run_lanes, _mm256_cmpgt_epi32(count, max_count)));
+        lane_failed = _mm256_and_si256(lane_failed, active);
+        __m256i finished = _mm256_cmpeq_epi32(pairs_read, plane_pairs);
+        failed = _mm256_or_si256(failed, lane_failed);
+        active = _mm256_andnot_si256(_mm256_or_si256(lane_failed, finished), active);
     }
-    fwrite(compressedImage.data, sizeof(uint8_t), compressedImage.byte_index, fp);
-    fclose(fp);
 
-    free(compressedImage.data);
-    free(buffer);
+    _mm256_storeu_si256((__m256i *)(lanes->position + first_lane), position);
+    lanes->valid &= ~((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(failed)) << first_lane);
 }
 
-void free_sprite(struct sprite_t *const sprite)
+TARGET_AVX512 static __m512i read_window_avx512(const uint8_t *const stream, const __m512i position)
 {
-    free(sprite->image);
-    sprite->image = NULL;
-    sprite->width = 0;
-    sprite->height = 0;
+    // Loads the 32 bits starting at each lane's position, first bit in the sign bit
+    const __m512i byte_swap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+    __m512i window = _mm512_i32gather_epi32(_mm512_srli_epi32(position, 3), (const void *)stream, 1);
+    window = _mm512_shuffle_epi8(window, byte_swap);
+    return _mm512_sllv_epi32(window, _mm512_and_si512(position, _mm512_set1_epi32(0x07)));
+}
+
+TARGET_AVX512 static void rle_decode_lanes_avx512(struct rle_lanes_t *const lanes)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i two = _mm512_set1_epi32(2);
+    const __m512i all_ones = _mm512_set1_epi32(-1);
+    const __m512i max_count = _mm512_set1_epi32(RLE_MAX_COUNT_BITS);
+    int32_t pair_values[16];
+    int32_t pair_index[16];
+
+    __m512i position = _mm512_loadu_si512(lanes->position);
+    __m512i end = _mm512_loadu_si512(lanes->end);
+    __m512i plane_pairs = _mm512_loadu_si512(lanes->plane_pairs);
+    __m512i pairs_read = zero;
+    __mmask16 active = lanes->valid & 0xffff;
+
+    __mmask16 data_packet = _mm512_cmplt_epi32_mask(read_window_avx512(lanes->stream, position), zero);
+    position = _mm512_add_epi32(position, one);
+    __mmask16 failed = _mm512_mask_cmple_epi32_mask(active, end, position);
+    active &= ~failed;
+
+    while (active)
+    {
+        __m512i window = read_window_avx512(lanes->stream, position);
+
+        // DATA lanes take a pixel pair, a 00 pair switches them to RUN
+        __m512i pair = _mm512_srli_epi32(window, 30);
+        __mmask16 pair_zero = _mm512_cmpeq_epi32_mask(pair, zero);
+        __mmask16 data_lanes = active & data_packet;
+        __mmask16 store = data_lanes & ~pair_zero;
+
+        // RUN lanes read L as a string of ones ending in a zero, then V with as many bits
+        __mmask16 run_lanes = active & ~data_packet;
+        __m512i count = _mm512_add_epi32(_mm512_lzcnt_epi32(_mm512_xor_si512(window, all_ones)), one);
+        __m512i length = _mm512_sub_epi32(_mm512_sllv_epi32(one, count), two);
+        __m512i value = _mm512_srlv_epi32(_mm512_sllv_epi32(window, count), _mm512_sub_epi32(_mm512_set1_epi32(32), count));
+        __m512i run = _mm512_add_epi32(_mm512_add_epi32(length, value), one);
+
+        // Every lane writes, zero unless it has a pair. The next pair or a run of zeros lands there anyway.
+        _mm512_storeu_si512(pair_values, _mm512_maskz_mov_epi32(store, pair));
+        _mm512_storeu_si512(pair_index, _mm512_min_epi32(pairs_read, plane_pairs));
+        for (uint8_t lane = 0; lane < 16; lane++)
+        {
+            lanes->pairs[lane][pair_index[lane]] = pair_values[lane];
+        }
+
+        position = _mm512_mask_add_epi32(position, data_lanes, position, two);
+        position = _mm512_mask_add_epi32(position, run_lanes, position, _mm512_slli_epi32(count, 1));
+        pairs_read = _mm512_mask_add_epi32(pairs_read, store, pairs_read, one);
+        pairs_read = _mm512_mask_add_epi32(pairs_read, run_lanes, pairs_read, run);
+        data_packet = (data_packet & ~(data_lanes & pair_zero)) | run_lanes;
+
+        __mmask16 lane_failed = _mm512_mask_cmpgt_epi32_mask(active, position, end) |
+                                _mm512_mask_cmpgt_epi32_mask(active, pairs_read, plane_pairs) |
+                                _mm512_mask_cmpgt_epi32_mask(run_lanes, count, max_count);
+        __mmask16 finished = _mm512_mask_cmpeq_epi32_mask(active, pairs_read, plane_pairs);
+        failed |= lane_failed;
+        active &= ~(lane_failed | finished);
+    }
+
+    _mm512_storeu_si512(lanes->position, position);
+    lanes->valid &= ~(uint32_t)failed;
+}
+
+static int compare_batch_order(const void *const a, const void *const b)
+{
+    const struct batch_order_t *const order_a = a;
+    const struct batch_order_t *const order_b = b;
+    if (order_a->size != order_b->size)
+    {
+        return (order_a->size < order_b->size) ? -1 : 1;
+    }
+    return (order_a->index < order_b->index) ? -1 : (order_a->index > order_b->index);
+}
+
+static void rle_decode_lanes(struct rle_lanes_t *const lanes, const enum batch_isa_t isa)
+{
+    if (isa == BATCH_AVX512)
+    {
+        rle_decode_lanes_avx512(lanes);
+    }
+    else
+    {
+        for (uint8_t first_lane = 0; first_lane < SPRITE_BATCH_LANES; first_lane += 8)
+        {
+            rle_decode_lanes_avx2(lanes, first_lane);
+        }
+    }
+}
+
+static void pack_bit_pairs(const uint8_t *const pairs, const uint8_t width_in_tiles, const uint8_t height_in_tiles, uint8_t *const output)
+{
+    // Pairs are in stream order, each column of bytes is four consecutive runs of rows
+    uint8_t rows = height_in_tiles * TILE_HEIGHT;
+    for (uint8_t x = 0; x < width_in_tiles * TILE_WIDTH; x++)
+    {
+        const uint8_t *column_pairs = pairs + x * rows * (PX_PER_BYTE >> 1);
+        for (uint8_t y = 0; y < rows; y++)
+        {
+            output[x * rows + y] = (column_pairs[y] << 6) | (column_pairs[rows + y] << 4) | (column_pairs[2 * rows + y] << 2) | column_pairs[3 * rows + y];
+        }
+    }
+}
+
+static uint8_t read_stream_bit(const uint8_t *const stream, int32_t *const position)
+{
+    uint8_t bit = (stream[*position >> 3] >> (7 - (*position & 0x07))) & 0x01;
+    (*position)++;
+    return bit;
+}
+
+static void decode_sprite_lanes(const uint8_t *const *const data, const size_t *const sizes, const uint8_t lane_count, uint8_t *const buffer, const enum batch_isa_t isa, struct sprite_t *const sprites)
+{
+    struct rle_lanes_t lanes = { .stream = buffer, .valid = 0 };
+    uint8_t *stream = buffer;
+    uint8_t *planes = buffer + SPRITE_BATCH_STREAM_SIZE;
+    uint8_t *BP0[SPRITE_BATCH_LANES];
+    uint8_t *BP1[SPRITE_BATCH_LANES];
+    int32_t stream_offset = 0;
+
+    for (uint8_t lane = 0; lane < SPRITE_BATCH_LANES; lane++)
+    {
+        struct sprite_t v_sprite = { .width=0, .height=0, .primary_buffer=0, .encoding_method=0, .image=NULL };
+        lanes.position[lane] = 0;
+        lanes.end[lane] = 0;
+        lanes.plane_pairs[lane] = 0;
+        lanes.pairs[lane] = planes + lane * SPRITE_BATCH_LANE_SIZE + BUFFER_SIZE * 2;
+        BP0[lane] = planes + lane * SPRITE_BATCH_LANE_SIZE;
+        BP1[lane] = BP0[lane] + BUFFER_SIZE;
+        if (lane >= lane_count)
+        {
+            continue;
+        }
+        sprites[lane] = v_sprite;
+        if (!valid_sprite_header(data[lane], sizes[lane]))
+        {
+            continue;
+        }
+
+        // Valid sprites never come close to the stream limit, longer data is cut off and fails to decode
+        size_t size = (sizes[lane] < SPRITE_STREAM_LIMIT) ? sizes[lane] : SPRITE_STREAM_LIMIT;
+        memcpy(stream + stream_offset, data[lane], size);
+
+        sprites[lane].width = data[lane][0] >> 4;
+        sprites[lane].height = data[lane][0] & 0x0f;
+        sprites[lane].primary_buffer = data[lane][1] >> 7;
+        lanes.position[lane] = (stream_offset + 1) * 8 + 1;
+        lanes.end[lane] = (stream_offset + size) * 8;
+        lanes.plane_pairs[lane] = sprites[lane].width * TILE_WIDTH * sprites[lane].height * TILE_HEIGHT * (PX_PER_BYTE >> 1);
+        lanes.valid |= 1 << lane;
+        stream_offset += size;
+    }
+    memset(stream + stream_offset, 0, SPRITE_BATCH_STREAM_SIZE - stream_offset);
+
+    for (uint8_t plane = 0; plane < 2; plane++)
+    {
+        for (uint8_t lane = 0; lane < lane_count; lane++)
+        {
+            if (lanes.valid & (1 << lane))
+            {
+                memset(lanes.pairs[lane], 0, lanes.plane_pairs[lane]);
+            }
+        }
+
+        rle_decode_lanes(&lanes, isa);
+
+        for (uint8_t lane = 0; lane < lane_count; lane++)
+        {
+            if (!(lanes.valid & (1 << lane)))
+            {
+                continue;
+            }
+            pack_bit_pairs(lanes.pairs[lane], sprites[lane].width, sprites[lane].height, (plane == 0) ? BP0[lane] : BP1[lane]);
+            if (plane == 0)
+            {
+                sprites[lane].encoding_method = read_stream_bit(stream, &lanes.position[lane]);
+                if (sprites[lane].encoding_method != 0)
+                {
+                    sprites[lane].encoding_method = (sprites[lane].encoding_method << 1) | read_stream_bit(stream, &lanes.position[lane]);
+                }
+            }
+        }
+    }
+
+    finish_sprites(sprites, BP0, BP1, lane_count, lanes.valid);
+}
+
+#endif
+
+void decode_sprite_batch(const uint8_t *const *const data, const size_t *const sizes, const size_t count, struct sprite_t *const sprites)
+{
+#if defined(SPRITE_BATCH_SIMD)
+    // Detected on each call rather than cached, so concurrent batches share no state
+    enum batch_isa_t isa = limit_batch_isa(detect_batch_isa());
+    if (isa != BATCH_SCALAR)
+    {
+        // Lanes run until the longest stream in the group is done, so sprites are grouped by stream size
+        struct batch_order_t *order = malloc(count * sizeof(struct batch_order_t));
+        for (size_t i = 0; i < count; i++)
+        {
+            order[i].size = sizes[i];
+            order[i].index = i;
+        }
+        qsort(order, count, sizeof(struct batch_order_t), compare_batch_order);
+
+        uint8_t *buffer = malloc(SPRITE_BATCH_STREAM_SIZE + SPRITE_BATCH_LANES * SPRITE_BATCH_LANE_SIZE);
+        for (size_t first = 0; first < count; first += SPRITE_BATCH_LANES)
+        {
+            const uint8_t *lane_data[SPRITE_BATCH_LANES];
+            size_t lane_sizes[SPRITE_BATCH_LANES];
+            struct sprite_t lane_sprites[SPRITE_BATCH_LANES];
+            uint8_t lane_count = (count - first < SPRITE_BATCH_LANES) ? count - first : SPRITE_BATCH_LANES;
+            for (uint8_t lane = 0; lane < lane_count; lane++)
+            {
+                lane_data[lane] = data[order[first + lane].index];
+                lane_sizes[lane] = sizes[order[first + lane].index];
+            }
+            decode_sprite_lanes(lane_data, lane_sizes, lane_count, buffer, isa, lane_sprites);
+            for (uint8_t lane = 0; lane < lane_count; lane++)
+            {
+                sprites[order[first + lane].index] = lane_sprites[lane];
+            }
+        }
+        free(buffer);
+        free(order);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; i++)
+    {
+        sprites[i] = decode_sprite(data[i], sizes[i]);
+    }
+}
+
+static void decode_column_planes(const uint8_t *const data, const size_t size, const uint8_t column_count, struct column_planes_t *const planes)
+{
+    memset(planes, 0, sizeof(struct column_planes_t));
+    if (!valid_sprite_header(data, size))
+    {
+        return;
+    }
+
+    uint8_t width = data[0] >> 4;
+    uint8_t height = data[0] & 0x0f;
+    uint8_t primary_buffer = data[1] >> 7;
+    uint8_t sprite_columns = width * TILE_WIDTH * PX_PER_BYTE;
+    uint8_t columns = (column_count < sprite_columns) ? column_count : sprite_columns;
+    uint64_t *BP0 = (primary_buffer) ? planes->high : planes->low;
+    uint64_t *BP1 = (primary_buffer) ? planes->low : planes->high;
+    struct bit_buffer_t bit_ptr =
+    {
+        .data = (uint8_t *)data,
+        .size = size,
+        .byte_index = 1,
+        .bit_index = 6
+    };
+
+    // The second plane starts after the first, so the first is always walked in full
+    if (rle_decode_columns(&bit_ptr, width, height, sprite_columns, BP0) != NO_ERROR)
+    {
+        return;
+    }
+    uint8_t encoding_method = read_encoding_method(&bit_ptr);
+    if (rle_decode_columns(&bit_ptr, width, height, columns, BP1) != NO_ERROR)
+    {
+        return;
+    }
+
+    // Undo delta coding on every row at once, one pixel column at a time
+    uint64_t last_bp0 = 0;
+    uint64_t last_bp1 = 0;
+    for (uint8_t c = 0; c < columns; c++)
+    {
+        last_bp0 ^= BP0[c];
+        BP0[c] = last_bp0;
+        if (encoding_method != 2)
+        {
+            last_bp1 ^= BP1[c];
+            BP1[c] = last_bp1;
+        }
+        if (encoding_method > 1)
+        {
+            BP1[c] ^= BP0[c];
+        }
+    }
+
+    planes->width = width;
+    planes->height = height;
+}
+
+static enum rle_error_t decode_sprite_plane(struct bit_buffer_t *const inputstream, const uint8_t width, const uint8_t height, const enum sprite_plane_t plane, uint8_t *const output, uint8_t *const scratch)
+{
+    size_t image_size = width * TILE_WIDTH * height * TILE_HEIGHT;
+    uint8_t primary_buffer = inputstream->data[1] >> 7;
+    enum sprite_plane_t bp0_plane = (primary_buffer) ? SPRITE_PLANE_HIGH : SPRITE_PLANE_LOW;
+    uint8_t *BP0 = (plane == SPRITE_PLANE_MASK || plane == bp0_plane) ? output : scratch;
+    uint8_t *BP1 = (BP0 == output) ? scratch : output;
+
+    // The second plane only starts after the first, so the first is always decoded. Its delta coding is only
+    // undone when the output depends on it.
+    enum rle_error_t error = rle_decode(inputstream, width, height, BP0);
+    if (plane == bp0_plane)
+    {
+        if (error == NO_ERROR)
+        {
+            diff_decode_buffer(width, height, BP0);
+        }
+        return error;
+    }
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+    uint8_t encoding_method = read_encoding_method(inputstream);
+    error = rle_decode(inputstream, width, height, BP1);
+    if (error != NO_ERROR)
+    {
+        return error;
+    }
+    if (encoding_method != 2)
+    {
+        diff_decode_buffer(width, height, BP1);
+    }
+
+    if (plane == SPRITE_PLANE_MASK)
+    {
+        // BP0 | (BP1 ^ BP0) == BP0 | BP1, so the XOR used by encoding methods 2 and 3 can be skipped
+        diff_decode_buffer(width, height, BP0);
+        for (size_t i = 0; i < image_size; i++)
+        {
+            BP0[i] |= BP1[i];
+        }
+    }
+    else if (encoding_method > 1)
+    {
+        diff_decode_buffer(width, height, BP0);
+        for (size_t i = 0; i < image_size; i++)
+        {
+            BP1[i] ^= BP0[i];
+        }
+    }
+    return NO_ERROR;
+}
+
+struct sprite_mask_t decode_sprite_plane_data(const uint8_t *const data, const size_t size, const enum sprite_plane_t plane)
+{
+    struct sprite_mask_t mask = { .width=0, .height=0, .data=NULL };
+    if (!valid_sprite_header(data, size))
+    {
+        return mask;
+    }
+
+    uint8_t width = data[0] >> 4;
+    uint8_t height = data[0] & 0x0f;
+    size_t image_size = width * TILE_WIDTH * height * TILE_HEIGHT;
+    uint8_t *output = malloc(image_size);
+    uint8_t *scratch = malloc(image_size);
+    struct bit_buffer_t bit_ptr =
+    {
+        .data = (uint8_t *)data,
+        .size = size,
+        .byte_index = 1,
+        .bit_index = 6
+    };
+
+    DEBUG_PRINT("Decoding plane %u of %ux%u tile sprite.\n", plane, width, height);
+    if (decode_sprite_plane(&bit_ptr, width, height, plane, output, scratch) != NO_ERROR)
+    {
+        free(output);
+    }
+    else
+    {
+        mask.width = width;
+        mask.height = height;
+        mask.data = output;
+    }
+
+    free(scratch);
+    return mask;
+}
+
+struct sprite_mask_t load_sprite_plane(const char *const filename, const enum sprite_plane_t plane)
+{
+    struct sprite_mask_t mask = { .width=0, .height=0, .data=NULL };
+    size_t filesize;
+    uint8_t *input = read_sprite_file(filename, &filesize);
+    if (input == NULL)
+    {
+        return mask;
+    }
+
+    mask = decode_sprite_plane_data(input, filesize, plane);
+    free(input);
+    return mask;
+}
+
+void free_sprite_mask(struct sprite_mask_t *const mask)
+{
+    free(mask->data);
+    mask->data = NULL;
+    mask->width = 0;
+    mask->height = 0;
+}
+
+static uint8_t count_bits(uint64_t mask)
+{
+    mask = mask - ((mask >> 1) & 0x5555555555555555);
+    mask = (mask & 0x3333333333333333) + ((mask >> 2) & 0x3333333333333333);
+    mask = (mask + (mask >> 4)) & 0x0f0f0f0f0f0f0f0f;
+    return (mask * 0x0101010101010101) >> 56;
+}
+
+static uint8_t lowest_bit(const uint64_t mask)
+{
+    uint8_t index = 0;
+    while (!((mask >> index) & 0x01))
+    {
+        index++;
+    }
+    return index;
+}
+
+static uint8_t highest_bit(const uint64_t mask)
+{
+    uint8_t index = 63;
+    while (!((mask >> index) & 0x01))
+    {
+        index--;
+    }
+    return index;
+}
+
+struct sprite_query_t query_sprite_data(const uint8_t *const data, const size_t size)
+{
+    struct sprite_query_t query = { .width=0, .height=0 };
+    struct column_planes_t planes;
+    decode_column_planes(data, size, BUFFER_WIDTH_IN_PX, &planes);
+    if (planes.width == 0)
+    {
+        return query;
+    }
+
+    uint8_t columns = planes.width * TILE_WIDTH * PX_PER_BYTE;
+    uint64_t occupied_rows = 0;
+    query.width = planes.width;
+    query.height = planes.height;
+
+    for (uint8_t c = 0; c < columns; c++)
+    {
+        uint64_t occupied = planes.low[c] | planes.high[c];
+        query.histogram[1] += count_bits(planes.low[c] & ~planes.high[c]);
+        query.histogram[2] += count_bits(planes.high[c] & ~planes.low[c]);
+        query.histogram[3] += count_bits(planes.low[c] & planes.high[c]);
+        if (occupied)
+        {
+            query.occupied_columns |= (uint64_t)1 << c;
+            occupied_rows |= occupied;
+        }
+    }
+    query.histogram[0] = columns * planes.height * TILE_HEIGHT - query.histogram[1] - query.histogram[2] - query.histogram[3];
+
+    if (query.occupied_columns)
+    {
+        query.bounds_x = lowest_bit(query.occupied_columns);
+        query.bounds_width = highest_bit(query.occupied_columns) - query.bounds_x + 1;
+        query.bounds_y = lowest_bit(occupied_rows);
+        query.bounds_height = highest_bit(occupied_rows) - query.bounds_y + 1;
+    }
+
+    return query;
+}
+
+uint8_t get_occupied_columns_data(const uint8_t *const data, const size_t size, const uint8_t column_count, uint64_t *const occupied_columns)
+{
+    // Only the first column_count columns of the second plane are walked
+    struct column_planes_t planes;
+    decode_column_planes(data, size, column_count, &planes);
+    *occupied_columns = 0;
+    if (planes.width == 0)
+    {
+        return 0;
+    }
+
+    uint8_t sprite_columns = planes.width * TILE_WIDTH * PX_PER_BYTE;
+    uint8_t columns = (column_count < sprite_columns) ? column_count : sprite_columns;
+    for (uint8_t c = 0; c < columns; c++)
+    {
+        if (planes.low[c] | planes.high[c])
+        {
+            *occupied_columns |= (uint64_t)1 << c;
+        }
+    }
+    return 1;
+}
+
+uint8_t is_sprite_column_empty_data(const uint8_t *const data, const size_t size, const uint8_t column, uint8_t *const empty)
+{
+    // Columns outside the frame are empty, but the sprite is still decoded so errors are reported
+    uint8_t column_count = (column < BUFFER_WIDTH_IN_PX) ? column + 1 : 0;
+    uint64_t occupied_columns;
+    uint8_t decoded = get_occupied_columns_data(data, size, column_count, &occupied_columns);
+    *empty = decoded && (column >= BUFFER_WIDTH_IN_PX || !((occupied_columns >> column) & 0x01));
+    return decoded;
+}
+
+struct sprite_query_t query_sprite(const char *const filename)
+{
+    struct sprite_query_t query = { .width=0, .height=0 };
+    size_t filesize;
+    uint8_t *input = read_sprite_file(filename, &filesize);
+    if (input == NULL)
+    {
+        return query;
+    }
+
+    query = query_sprite_data(input, filesize);
+    free(input);
+    return query;
+}
+
+uint8_t get_occupied_columns(const char *const filename, const uint8_t column_count, uint64_t *const occupied_columns)
+{
+    size_t filesize;
+    uint8_t *input = read_sprite_file(filename, &filesize);
+    if (input == NULL)
+    {
+        *occupied_columns = 0;
+        return 0;
+    }
+
+    uint8_t decoded = get_occupied_columns_data(input, filesize, column_count, occupied_columns);
+    free(input);
+    return decoded;
+}
+
+uint8_t is_sprite_column_empty(const char *const filename, const uint8_t column, uint8_t *const empty)
+{
+    size_t filesize;
+    uint8_t *input = read_sprite_file(filename, &filesize);
+    if (input == NULL)
+    {
+        *empty = 0;
+        return 0;
+    }
+
+    uint8_t decoded = is_sprite_column_empty_data(input, filesize, column, empty);
+    free(input);
+    return decoded;
+}
+
+void save_sprite(const struct sprite_t *const v_sprite, const uint8_t encoding_method, const uint8_t primary_buffer, const char *const filename)
+{
+    uint8_t *buffer = calloc(BUFFER_SIZE * 3, sizeof(uint8_t));
+    uint8_t *BUF_A = buffer;
+    uint8_t *BUF_B = buffer + BUFFER_SIZE;
+    uint8_t *BUF_C = buffer + 2 * BUFFER_SIZE;
+    uint8_t *BP0 = (primary_buffer) ? BUF_C : BUF_B;
+    uint8_t *BP1 = (primary_buffer) ? BUF_B : BUF_C;
+
+    separate_bitplanes(v_sprite->image, BUFFER_SIZE, BUF_A, BUF_B);
+    remove_sprite_offset(BUF_B, BUFFER_WIDTH_IN_TILES, BUFFER_HEIGHT_IN_TILES, BUF_C, v_sprite->width, v_sprite->height);
+    remove_sprite_offset(BUF_A, BUFFER_WIDTH_IN_TILES, BUFFER_HEIGHT_IN_TILES, BUF_B, v_sprite->width, v_sprite->height);
+
+    if (encoding_method > 1)
+    {
+        for (size_t i = 0; i < v_sprite->width * TILE_WIDTH * v_sprite->height * TILE_HEIGHT; i++)
+        {
+            BP1[i] = BP0[i] ^ BP1[i];
+        }
+    }
+    if (encoding_method != 2)
+    {
+        diff_encode_buffer(v_sprite->width, v_sprite->height, BP1);
+    }
+    diff_encode_buffer(v_sprite->width, v_sprite->height, BP0);
+
+    struct bit_buffer_t compressedImage =
+    {
+        .data = calloc(BUFFER_SIZE * 2, sizeof(uint8_t)),
+        .size = BUFFER_SIZE * 2
+    };
+
+    compressedImage.data[0] = v_sprite->width << 4 | v_sprite->height;
+    compressedImage.data[1] = primary_buffer << 7;
+    compressedImage.byte_index = 1;
+    compressedImage.bit_index = 6;
+
+    rle_encode(BP0, v_sprite->width, v_sprite->height, &compressedImage);
+    int16_t count = (encoding_method == 0) ? 1 : 2;
+    write_buffer(encoding_method, count, &compressedImage);
+    rle_encode(BP1, v_sprite->width, v_sprite->height, &compressedImage);
+
+    if (compressedImage.bit_index != 7)
+    {
+        compressedImage.byte_index++;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if(fp == NULL)
+    {
+        fprintf(stderr, "Unable to open file [%s] for writing\n", filename);
+        return;
+    }
+    fwrite(compressedImage.data, sizeof(uint8_t), compressedImage.byte_index, fp);
+    fclose(fp);
+
+    free(compressedImage.data);
+    free(buffer);
+}
+
+void free_sprite(struct sprite_t *const sprite)
+{
+    free(sprite->image);
+    sprite->image = NULL;
+    sprite->width = 0;
+    sprite->height = 0;
+}
+
+static void flip_tile(const uint8_t *const tile, const uint8_t flip, uint8_t *const output)
+{
+    for (uint8_t r = 0; r < TILE_HEIGHT; r++)
+    {
+        uint8_t source_row = (flip & TILE_FLIP_Y) ? TILE_HEIGHT - 1 - r : r;
+        for (uint8_t plane = 0; plane < 2; plane++)
+        {
+            uint8_t byte = tile[source_row * 2 + plane];
+            if (flip & TILE_FLIP_X)
+            {
+                byte = ((byte & 0xf0) >> 4) | ((byte & 0x0f) << 4);
+                byte = ((byte & 0xcc) >> 2) | ((byte & 0x33) << 2);
+                byte = ((byte & 0xaa) >> 1) | ((byte & 0x55) << 1);
+            }
+            output[r * 2 + plane] = byte;
+        }
+    }
+}
+
+static uint32_t hash_tile(const uint8_t *const tile)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < GB_TILE_SIZE; i++)
+    {
+        hash = (hash ^ tile[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void insert_tile_hash(uint16_t *const hash_index, const size_t hash_capacity, const uint8_t *const tile, const size_t tile_index)
+{
+    size_t slot = hash_tile(tile) & (hash_capacity - 1);
+    while (hash_index[slot] != TILE_HASH_EMPTY)
+    {
+        slot = (slot + 1) & (hash_capacity - 1);
+    }
+    hash_index[slot] = tile_index + 1;
+}
+
+static uint8_t grow_tile_set(struct tile_set_t *const tile_set)
+{
+    if (tile_set->tile_count == tile_set->tile_capacity)
+    {
+        size_t tile_capacity = tile_set->tile_capacity << 1;
+        uint8_t *tiles = realloc(tile_set->tiles, tile_capacity * GB_TILE_SIZE);
+        if (tiles == NULL)
+        {
+            return 0;
+        }
+        tile_set->tiles = tiles;
+        uint8_t *tile_attributes = realloc(tile_set->tile_attributes, tile_capacity);
+        if (tile_attributes == NULL)
+        {
+            return 0;
+        }
+        tile_set->tile_attributes = tile_attributes;
+        tile_set->tile_capacity = tile_capacity;
+    }
+
+    // Keep the hash index at most half full
+    if ((tile_set->tile_count + 1) << 1 > tile_set->hash_capacity)
+    {
+        size_t hash_capacity = tile_set->hash_capacity << 1;
+        uint16_t *hash_index = calloc(hash_capacity, sizeof(uint16_t));
+        if (hash_index == NULL)
+        {
+            return 0;
+        }
+        for (size_t i = 0; i < tile_set->tile_count; i++)
+        {
+            insert_tile_hash(hash_index, hash_capacity, tile_set->tiles + i * GB_TILE_SIZE, i);
+        }
+        free(tile_set->hash_index);
+        tile_set->hash_index = hash_index;
+        tile_set->hash_capacity = hash_capacity;
+    }
+    return 1;
+}
+
+static size_t find_or_insert_tile(struct tile_set_t *const tile_set, const uint8_t *const tile, const uint8_t attribute, uint8_t *const inserted)
+{
+    size_t slot = hash_tile(tile) & (tile_set->hash_capacity - 1);
+    while (tile_set->hash_index[slot] != TILE_HASH_EMPTY)
+    {
+        size_t tile_index = tile_set->hash_index[slot] - 1;
+        if (memcmp(tile_set->tiles + tile_index * GB_TILE_SIZE, tile, GB_TILE_SIZE) == 0)
+        {
+            *inserted = 0;
+            return tile_index;
+        }
+        slot = (slot + 1) & (tile_set->hash_capacity - 1);
+    }
+
+    if (tile_set->tile_count >= UINT16_MAX)
+    {
+        fprintf(stderr, "Tile set full\n");
+        return SIZE_MAX;
+    }
+    if (!grow_tile_set(tile_set))
+    {
+        fprintf(stderr, "Unable to grow tile set\n");
+        return SIZE_MAX;
+    }
+
+    size_t tile_index = tile_set->tile_count;
+    memcpy(tile_set->tiles + tile_index * GB_TILE_SIZE, tile, GB_TILE_SIZE);
+    tile_set->tile_attributes[tile_index] = attribute;
+    insert_tile_hash(tile_set->hash_index, tile_set->hash_capacity, tile, tile_index);
+    tile_set->tile_count++;
+    *inserted = 1;
+    return tile_index;
+}
+
+static void remove_tiles_from(struct tile_set_t *const tile_set, const size_t first_tile)
+{
+    // Tiles are hashed in index order, so no earlier tile's probe sequence passes through a later one's slot
+    for (size_t slot = 0; slot < tile_set->hash_capacity; slot++)
+    {
+        if (tile_set->hash_index[slot] > first_tile)
+        {
+            tile_set->hash_index[slot] = TILE_HASH_EMPTY;
+        }
+    }
+    tile_set->tile_count = first_tile;
+}
+
+struct tile_set_t create_tile_set(const uint8_t flip_dedup)
+{
+    struct tile_set_t tile_set =
+    {
+        .tiles = malloc(TILE_HASH_INITIAL_CAPACITY * GB_TILE_SIZE),
+        .tile_attributes = malloc(TILE_HASH_INITIAL_CAPACITY),
+        .hash_index = calloc(TILE_HASH_INITIAL_CAPACITY * 2, sizeof(uint16_t)),
+        .tile_count = 0,
+        .tile_capacity = TILE_HASH_INITIAL_CAPACITY,
+        .hash_capacity = TILE_HASH_INITIAL_CAPACITY * 2,
+        .tiles_added = 0,
+        .flip_matches = 0,
+        .flip_dedup = flip_dedup
+    };
+    return tile_set;
+}
+
+struct tile_map_t add_sprite_to_tile_set(struct tile_set_t *const tile_set, const struct sprite_t *const sprite)
+{
+    struct tile_map_t tile_map = { .width=0, .height=0, .indices=NULL, .attributes=NULL };
+    if (sprite->image == NULL || tile_set->tiles == NULL || tile_set->tile_attributes == NULL || tile_set->hash_index == NULL)
+    {
+        fprintf(stderr, "Invalid sprite or tile set\n");
+        return tile_map;
+    }
+    if (sprite->width < 1 || sprite->width > BUFFER_WIDTH_IN_TILES || sprite->height < 1 || sprite->height > BUFFER_HEIGHT_IN_TILES)
+    {
+        fprintf(stderr, "Invalid sprite dimensions: %ux%u tiles\n", sprite->width, sprite->height);
+        return tile_map;
+    }
+
+    uint8_t width_offset_in_tiles = (BUFFER_WIDTH_IN_TILES - sprite->width + 1) >> 1;
+    uint8_t height_offset_in_tiles = BUFFER_HEIGHT_IN_TILES - sprite->height;
+    size_t map_size = sprite->width * sprite->height;
+
+    tile_map.width = sprite->width;
+    tile_map.height = sprite->height;
+    tile_map.indices = malloc(map_size * sizeof(uint16_t));
+    tile_map.attributes = malloc(map_size * sizeof(uint8_t));
+
+    // The set only takes this sprite's tiles and counts once all of them are in
+    size_t first_new_tile = tile_set->tile_count;
+    size_t flip_matches = 0;
+
+    for (uint8_t ty = 0; ty < sprite->height; ty++)
+    {
+        for (uint8_t tx = 0; tx < sprite->width; tx++)
+        {
+            uint8_t tile[GB_TILE_SIZE];
+            uint8_t canonical[GB_TILE_SIZE];
+            uint8_t flipped[GB_TILE_SIZE];
+            uint8_t attribute = 0;
+
+            size_t index = (width_offset_in_tiles + tx) * TILE_WIDTH * BUFFER_HEIGHT_IN_TILES * TILE_HEIGHT + (height_offset_in_tiles + ty) * TILE_HEIGHT;
+            for (uint8_t r = 0; r < TILE_HEIGHT; r++)
+            {
+                separate_bitplanes(sprite->image + index + r, 1, tile + r * 2, tile + r * 2 + 1);
+            }
+            memcpy(canonical, tile, GB_TILE_SIZE);
+
+            // Store the smallest of the flipped variants so that mirrored tiles share an entry
+            if (tile_set->flip_dedup)
+            {
+                const uint8_t flips[] = {TILE_FLIP_X, TILE_FLIP_Y, TILE_FLIP_X | TILE_FLIP_Y};
+                for (uint8_t i = 0; i < sizeof(flips); i++)
+                {
+                    flip_tile(tile, flips[i], flipped);
+                    if (memcmp(flipped, canonical, GB_TILE_SIZE) < 0)
+                    {
+                        memcpy(canonical, flipped, GB_TILE_SIZE);
+                        attribute = flips[i];
+                    }
+                }
+            }
+
+            uint8_t inserted;
+            size_t tile_index = find_or_insert_tile(tile_set, canonical, attribute, &inserted);
+            if (tile_index == SIZE_MAX)
+            {
+                remove_tiles_from(tile_set, first_new_tile);
+                free_tile_map(&tile_map);
+                return tile_map;
+            }
+            // A match only needed a flip if this tile maps to the stored one differently from the tile that added it
+            if (!inserted && attribute != tile_set->tile_attributes[tile_index])
+            {
+                flip_matches++;
+            }
+
+            tile_map.indices[ty * sprite->width + tx] = tile_index;
+            tile_map.attributes[ty * sprite->width + tx] = attribute;
+        }
+    }
+
+    tile_set->tiles_added += map_size;
+    tile_set->flip_matches += flip_matches;
+
+    DEBUG_PRINT("Tile set holds %zu unique tiles from %zu\n", tile_set->tile_count, tile_set->tiles_added);
+    return tile_map;
+}
+
+struct sprite_t tile_map_to_sprite(const struct tile_set_t *const tile_set, const struct tile_map_t *const tile_map)
+{
+    struct sprite_t v_sprite = { .width=0, .height=0, .primary_buffer=0, .encoding_method=0, .image=NULL };
+    if (tile_map->indices == NULL || tile_map->attributes == NULL || tile_set->tiles == NULL)
+    {
+        fprintf(stderr, "Invalid tile map\n");
+        return v_sprite;
+    }
+    if (tile_map->width < 1 || tile_map->width > BUFFER_WIDTH_IN_TILES || tile_map->height < 1 || tile_map->height > BUFFER_HEIGHT_IN_TILES)
+    {
+        fprintf(stderr, "Invalid tile map dimensions: %ux%u tiles\n", tile_map->width, tile_map->height);
+        return v_sprite;
+    }
+    for (size_t i = 0; i < (size_t)tile_map->width * tile_map->height; i++)
+    {
+        if (tile_map->indices[i] >= tile_set->tile_count)
+        {
+            fprintf(stderr, "Tile index %u not in tile set\n", tile_map->indices[i]);
+            return v_sprite;
+        }
+    }
+
+    uint8_t width_offset_in_tiles = (BUFFER_WIDTH_IN_TILES - tile_map->width + 1) >> 1;
+    uint8_t height_offset_in_tiles = BUFFER_HEIGHT_IN_TILES - tile_map->height;
+
+    v_sprite.width = tile_map->width;
+    v_sprite.height = tile_map->height;
+    v_sprite.image = calloc(BUFFER_SIZE, sizeof(uint16_t));
+
+    for (uint8_t ty = 0; ty < tile_map->height; ty++)
+    {
+        for (uint8_t tx = 0; tx < tile_map->width; tx++)
+        {
+            uint8_t tile[GB_TILE_SIZE];
+            size_t tile_index = tile_map->indices[ty * tile_map->width + tx];
+            flip_tile(tile_set->tiles + tile_index * GB_TILE_SIZE, tile_map->attributes[ty * tile_map->width + tx], tile);
+
+            size_t index = (width_offset_in_tiles + tx) * TILE_WIDTH * BUFFER_HEIGHT_IN_TILES * TILE_HEIGHT + (height_offset_in_tiles + ty) * TILE_HEIGHT;
+            for (uint8_t r = 0; r < TILE_HEIGHT; r++)
+            {
+                interleave_bitplanes(tile + r * 2, tile + r * 2 + 1, 1, v_sprite.image + index + r);
+            }
+        }
+    }
+
+    return v_sprite;
+}
+
+struct tile_set_stats_t get_tile_set_stats(const struct tile_set_t *const tile_set)
+{
+    struct tile_set_stats_t stats =
+    {
+        .tiles_added = tile_set->tiles_added,
+        .unique_tiles = tile_set->tile_count,
+        .flip_matches = tile_set->flip_matches,
+        .bytes_in = tile_set->tiles_added * GB_TILE_SIZE,
+        .bytes_out = tile_set->tile_count * GB_TILE_SIZE,
+        .dedup_ratio = 1.0
+    };
+    if (tile_set->tile_count > 0)
+    {
+        stats.dedup_ratio = (double)tile_set->tiles_added / tile_set->tile_count;
+    }
+    return stats;
+}
+
+void free_tile_map(struct tile_map_t *const tile_map)
+{
+    free(tile_map->indices);
+    free(tile_map->attributes);
+    tile_map->indices = NULL;
+    tile_map->attributes = NULL;
+    tile_map->width = 0;
+    tile_map->height = 0;
+}
+
+void free_tile_set(struct tile_set_t *const tile_set)
+{
+    free(tile_set->tiles);
+    free(tile_set->tile_attributes);
+    free(tile_set->hash_index);
+    tile_set->tiles = NULL;
+    tile_set->tile_attributes = NULL;
+    tile_set->hash_index = NULL;
+    tile_set->tile_count = 0;
+    tile_set->tile_capacity = 0;
+    tile_set->hash_capacity = 0;
+    tile_set->tiles_added = 0;
+    tile_set->flip_matches = 0;
 }
@@ -0,0 +1,291 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "sprite.h"
+#include "sprite_scan.h"
+
+#define ITERATIONS 20000
+#define SOURCE_FILE_COUNT 7
+#define BATCH_SIZE 64
+#define LARGE_SPRITE_COUNT 7
+#define LARGE_ITERATIONS 2000
+
+const char *const source_files[SOURCE_FILE_COUNT] = {
+    "../../test/test_images/test_1x1_01.bin",
+    "../../test/test_images/test_1x1_02_b1.bin",
+    "../../test/test_images/test_1x1_02_b2.bin",
+    "../../test/test_images/test_1x1_02_b3.bin",
+    "../../test/test_images/test_1x1_02_c1.bin",
+    "../../test/test_images/test_1x1_02_c2.bin",
+    "../../test/test_images/test_1x1_02_c3.bin"};
+
+static uint32_t count_pixels(const struct sprite_t *const sprite)
+{
+    struct sprite_query_t query = scan_sprite(sprite);
+    return query.histogram[1] + query.histogram[2] + query.histogram[3];
+}
+
+static double elapsed_ns(const clock_t start)
+{
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / (ITERATIONS * SOURCE_FILE_COUNT);
+}
+
+static uint8_t *read_file(const char *const filename, size_t *const size)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Failed to open [%s]\n", filename);
+        *size = 0;
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    uint8_t *data = malloc(*size);
+    if (fread(data, sizeof(uint8_t), *size, fp) < *size)
+    {
+        fprintf(stderr, "Failed to read [%s]\n", filename);
+    }
+    fclose(fp);
+    return data;
+}
+
+static double batch_elapsed_ns(const clock_t start, const int iterations)
+{
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / ((double)iterations * BATCH_SIZE);
+}
+
+static uint32_t next_random(uint32_t *const seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 16;
+}
+
+static uint8_t *make_large_sprite(const int index, size_t *const size)
+{
+    // Sparse noise over part of each tile's rows, so stream lengths vary with the size and the content
+    const uint8_t dimensions[LARGE_SPRITE_COUNT][2] = {{7, 7}, {6, 5}, {4, 4}, {3, 2}, {2, 7}, {5, 1}, {7, 3}};
+    const uint8_t encoding_methods[3] = {0, 2, 3};
+    uint32_t seed = index + 1;
+    struct sprite_t sprite = { .width = dimensions[index][0], .height = dimensions[index][1] };
+    size_t offset = sprite_frame_offset(&sprite);
+
+    sprite.image = calloc(TEST_FRAME_HEIGHT * TEST_FRAME_TILES, sizeof(uint16_t));
+    for (int x = 0; x < sprite.width; x++)
+    {
+        for (int y = 0; y < sprite.height * TEST_TILE_ROWS; y++)
+        {
+            uint16_t pixels = next_random(&seed) & next_random(&seed);
+            sprite.image[offset + x * TEST_FRAME_HEIGHT + y] = ((y & 7) < 4 + (index & 3)) ? pixels : 0;
+        }
+    }
+    save_sprite(&sprite, encoding_methods[index % 3], index & 0x01, "benchmark.bin");
+    free_sprite(&sprite);
+
+    uint8_t *data = read_file("benchmark.bin", size);
+    remove("benchmark.bin");
+    return data;
+}
+
+static uint32_t time_decoders(const char *const label, const uint8_t *const *const data, const size_t *const sizes, const int iterations)
+{
+    // Both decoders share the same post-processing, so the difference is the bitplane decoding alone
+    struct sprite_t sprites[BATCH_SIZE];
+    uint32_t checksum = 0;
+    char name[32];
+
+    clock_t start = clock();
+    for (int i = 0; i < iterations; i++)
+    {
+        for (int s = 0; s < BATCH_SIZE; s++)
+        {
+            struct sprite_t sprite = decode_sprite(data[s], sizes[s]);
+            if (sprite.image != NULL)
+            {
+                checksum += sprite.image[sprite_frame_offset(&sprite)];
+            }
+            free_sprite(&sprite);
+        }
+    }
+    snprintf(name, sizeof(name), "decode_sprite %s:", label);
+    printf("%-24s%8.1f ns/sprite\n", name, batch_elapsed_ns(start, iterations));
+
+    start = clock();
+    for (int i = 0; i < iterations; i++)
+    {
+        decode_sprite_batch(data, sizes, BATCH_SIZE, sprites);
+        for (int s = 0; s < BATCH_SIZE; s++)
+        {
+            if (sprites[s].image != NULL)
+            {
+                checksum -= sprites[s].image[sprite_frame_offset(&sprites[s])];
+            }
+            free_sprite(&sprites[s]);
+        }
+    }
+    snprintf(name, sizeof(name), "decode_sprite_batch %s:", label);
+    printf("%-24s%8.1f ns/sprite\n", name, batch_elapsed_ns(start, iterations));
+    return checksum;
+}
+
+int main()
+{
+    uint32_t checksum = 0;
+
+    clock_t start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int f = 0; f < SOURCE_FILE_COUNT; f++)
+        {
+            struct sprite_t sprite = load_sprite(source_files[f]);
+            if (sprite.image != NULL)
+            {
+                checksum += count_pixels(&sprite);
+            }
+            free_sprite(&sprite);
+        }
+    }
+    printf("load_sprite + scan:     %8.1f ns/sprite\n", elapsed_ns(start));
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int f = 0; f < SOURCE_FILE_COUNT; f++)
+        {
+            struct sprite_query_t query = query_sprite(source_files[f]);
+            checksum -= query.histogram[1] + query.histogram[2] + query.histogram[3];
+        }
+    }
+    printf("query_sprite:           %8.1f ns/sprite\n", elapsed_ns(start));
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int f = 0; f < SOURCE_FILE_COUNT; f++)
+        {
+            uint8_t empty;
+            if (is_sprite_column_empty(source_files[f], 0, &empty))
+            {
+                checksum += empty;
+            }
+        }
+    }
+    printf("is_sprite_column_empty: %8.1f ns/sprite\n", elapsed_ns(start));
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int f = 0; f < SOURCE_FILE_COUNT; f++)
+        {
+            struct sprite_mask_t mask = load_sprite_plane(source_files[f], SPRITE_PLANE_MASK);
+            if (mask.data != NULL)
+            {
+                checksum += mask.data[0];
+            }
+            free_sprite_mask(&mask);
+        }
+    }
+    printf("load_sprite_plane:      %8.1f ns/sprite\n", elapsed_ns(start));
+
+    // Decoding from memory, one core, to compare per sprite throughput without file access
+    const uint8_t *data[BATCH_SIZE];
+    size_t sizes[BATCH_SIZE];
+    const uint8_t *large_data[LARGE_SPRITE_COUNT];
+    size_t large_sizes[LARGE_SPRITE_COUNT];
+    const uint8_t *mixed_data[BATCH_SIZE];
+    size_t mixed_sizes[BATCH_SIZE];
+    uint8_t missing = 0;
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        data[i] = read_file(source_files[i % SOURCE_FILE_COUNT], &sizes[i]);
+        missing |= data[i] == NULL;
+    }
+    for (int i = 0; i < LARGE_SPRITE_COUNT; i++)
+    {
+        large_data[i] = make_large_sprite(i, &large_sizes[i]);
+        missing |= large_data[i] == NULL;
+    }
+    if (missing)
+    {
+        return 1;
+    }
+
+    // Sprites from 1x1 to 7x7 in one batch, so lanes finish at different times
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        mixed_data[i] = (i & 0x01) ? data[i] : large_data[(i >> 1) % LARGE_SPRITE_COUNT];
+        mixed_sizes[i] = (i & 0x01) ? sizes[i] : large_sizes[(i >> 1) % LARGE_SPRITE_COUNT];
+    }
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int s = 0; s < BATCH_SIZE; s++)
+        {
+            struct sprite_t sprite = decode_sprite(data[s], sizes[s]);
+            if (sprite.image != NULL)
+            {
+                checksum += count_pixels(&sprite);
+            }
+            free_sprite(&sprite);
+        }
+    }
+    printf("decode_sprite + scan:   %8.1f ns/sprite\n", batch_elapsed_ns(start, ITERATIONS));
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int s = 0; s < BATCH_SIZE; s++)
+        {
+            struct sprite_query_t query = query_sprite_data(data[s], sizes[s]);
+            checksum -= query.histogram[1] + query.histogram[2] + query.histogram[3];
+        }
+    }
+    printf("query_sprite_data:      %8.1f ns/sprite\n", batch_elapsed_ns(start, ITERATIONS));
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int s = 0; s < BATCH_SIZE; s++)
+        {
+            uint64_t occupied_columns;
+            if (get_occupied_columns_data(data[s], sizes[s], 64, &occupied_columns))
+            {
+                checksum += occupied_columns & 0x01;
+            }
+        }
+    }
+    printf("get_occupied_columns:   %8.1f ns/sprite\n", batch_elapsed_ns(start, ITERATIONS));
+
+    start = clock();
+    for (int i = 0; i < ITERATIONS; i++)
+    {
+        for (int s = 0; s < BATCH_SIZE; s++)
+        {
+            struct sprite_mask_t mask = decode_sprite_plane_data(data[s], sizes[s], SPRITE_PLANE_MASK);
+            if (mask.data != NULL)
+            {
+                checksum += mask.data[0];
+            }
+            free_sprite_mask(&mask);
+        }
+    }
+    printf("decode_sprite_plane:    %8.1f ns/sprite\n", batch_elapsed_ns(start, ITERATIONS));
+
+    checksum += time_decoders("1x1", data, sizes, ITERATIONS);
+    checksum += time_decoders("mixed", mixed_data, mixed_sizes, LARGE_ITERATIONS);
+
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        free((uint8_t *)data[i]);
+    }
+    for (int i = 0; i < LARGE_SPRITE_COUNT; i++)
+    {
+        free((uint8_t *)large_data[i]);
+    }
+
+    printf("Checksum: %u\n", checksum);
+    return 0;
+}
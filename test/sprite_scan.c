@@ -0,0 +1,43 @@
+#include "sprite_scan.h"
+
+size_t sprite_frame_offset(const struct sprite_t *const sprite)
+{
+    // Sprites sit centred horizontally and against the bottom of the frame
+    size_t width_offset = (TEST_FRAME_TILES - sprite->width + 1) >> 1;
+    size_t height_offset = TEST_FRAME_TILES - sprite->height;
+    return width_offset * TEST_FRAME_HEIGHT + height_offset * TEST_TILE_ROWS;
+}
+
+struct sprite_query_t scan_sprite(const struct sprite_t *const sprite)
+{
+    // Reference for query_sprite, read pixel by pixel from the decoded image
+    struct sprite_query_t query = { .width = sprite->width, .height = sprite->height };
+    size_t offset = sprite_frame_offset(sprite);
+    int min_x = 64, min_y = 64, max_x = -1, max_y = -1;
+
+    for (int y = 0; y < sprite->height * TEST_TILE_ROWS; y++)
+    {
+        for (int x = 0; x < sprite->width * 8; x++)
+        {
+            uint16_t pixels = sprite->image[offset + (x >> 3) * TEST_FRAME_HEIGHT + y];
+            uint8_t colour = (pixels >> (14 - ((x & 7) << 1))) & 0x03;
+            query.histogram[colour]++;
+            if (colour)
+            {
+                query.occupied_columns |= (uint64_t)1 << x;
+                min_x = (x < min_x) ? x : min_x;
+                max_x = (x > max_x) ? x : max_x;
+                min_y = (y < min_y) ? y : min_y;
+                max_y = (y > max_y) ? y : max_y;
+            }
+        }
+    }
+    if (max_x >= 0)
+    {
+        query.bounds_x = min_x;
+        query.bounds_y = min_y;
+        query.bounds_width = max_x - min_x + 1;
+        query.bounds_height = max_y - min_y + 1;
+    }
+    return query;
+}
@@ -0,0 +1,15 @@
+#ifndef SPRITE_SCAN_H_INCLUDED
+#define SPRITE_SCAN_H_INCLUDED
+
+#include <stddef.h>
+#include "sprite.h"
+
+// Sprite images are a 7x7 tile frame, stored as columns of 8 pixel wide rows
+#define TEST_FRAME_TILES 7
+#define TEST_TILE_ROWS 8
+#define TEST_FRAME_HEIGHT (TEST_FRAME_TILES * TEST_TILE_ROWS)
+
+size_t sprite_frame_offset(const struct sprite_t *const sprite);
+struct sprite_query_t scan_sprite(const struct sprite_t *const sprite);
+
+#endif // SPRITE_SCAN_H_INCLUDED
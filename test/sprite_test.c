@@ -1,18 +1,24 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdint.h>
 #include "cmocka.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include "sprite.h"
+#include "sprite_scan.h"
 
 #define PRIMARY_BUFFER_B 0
 #define PRIMARY_BUFFER_C 1
 #define TEST_BUFFER_SIZE 392
 #define TEST_1X1_02_OFFSET 216
+#define TEST_3X2_OFFSET (2 * TEST_FRAME_HEIGHT + 5 * TEST_TILE_ROWS)
+#define TEST_3X2_VARIANTS 6
 
 const char *const b1 = "../../test/test_images/test_1x1_02_b1.bin";
 const char *const b2 = "../../test/test_images/test_1x1_02_b2.bin";
@@ -48,6 +54,33 @@ struct sprite_t test_sprite()
     return sprite;
 }
 
+// 3x2 sprite with test_1x1_02_sprite in each tile set in tiles, bit 0 for the top left tile
+struct sprite_t test_3x2_sprite(const uint8_t tiles)
+{
+    struct sprite_t sprite = {
+        .width = 3,
+        .height = 2,
+        .encoding_method = 0,
+        .primary_buffer = 0
+    };
+    sprite.image = calloc(TEST_BUFFER_SIZE, sizeof(uint16_t));
+    for (int t = 0; t < 6; t++)
+    {
+        if (tiles & (1 << t))
+        {
+            memcpy(sprite.image + TEST_3X2_OFFSET + (t % 3) * TEST_FRAME_HEIGHT + (t / 3) * TEST_TILE_ROWS, test_1x1_02_sprite, 16);
+        }
+    }
+    return sprite;
+}
+
+// Saves one of TEST_3X2_VARIANTS encodings: methods 0, 2 and 3 with each primary buffer
+void save_test_3x2_variant(const struct sprite_t *const sprite, const int variant, const char *const filename)
+{
+    const uint8_t encoding_methods[] = {0, 2, 3};
+    save_sprite(sprite, encoding_methods[variant % 3], variant / 3, filename);
+}
+
 size_t get_file_size(const char *filename)
 {
     struct stat stbuf;
@@ -58,6 +91,17 @@ size_t get_file_size(const char *filename)
     return stbuf.st_size;
 }
 
+uint8_t *read_test_file_data(const char *const filename, size_t *const size)
+{
+    *size = get_file_size(filename);
+    uint8_t *data = malloc(*size);
+    FILE *fp = fopen(filename, "rb");
+    assert_non_null(fp);
+    assert_uint_equal(fread(data, sizeof(uint8_t), *size, fp), *size);
+    fclose(fp);
+    return data;
+}
+
 static void read_test_file(void **state)
 {
     (void)state;
@@ -122,12 +166,419 @@ static void encoding(void **state)
     free_sprite(&sprite);
 }
 
+struct sprite_t flipped_test_sprite()
+{
+    struct sprite_t sprite = test_sprite();
+    for (int r = 0; r < 8; r++)
+    {
+        sprite.image[TEST_1X1_02_OFFSET + r] = test_1x1_02_sprite[7 - r];
+    }
+    return sprite;
+}
+
+static void tile_deduplication(void **state)
+{
+    (void)state;
+    struct sprite_t sprites[3] = {test_sprite(), test_sprite(), flipped_test_sprite()};
+
+    struct tile_set_t tile_set = create_tile_set(0);
+    for (int i = 0; i < 3; i++)
+    {
+        struct tile_map_t tile_map = add_sprite_to_tile_set(&tile_set, &sprites[i]);
+        assert_non_null(tile_map.indices);
+        assert_int_equal(tile_map.attributes[0], 0);
+        free_tile_map(&tile_map);
+    }
+    struct tile_set_stats_t stats = get_tile_set_stats(&tile_set);
+    assert_uint_equal(stats.tiles_added, 3);
+    assert_uint_equal(stats.unique_tiles, 2);
+    assert_uint_equal(stats.flip_matches, 0);
+    free_tile_set(&tile_set);
+
+    tile_set = create_tile_set(1);
+    for (int i = 0; i < 3; i++)
+    {
+        struct tile_map_t tile_map = add_sprite_to_tile_set(&tile_set, &sprites[i]);
+        assert_uint_equal(tile_map.indices[0], 0);
+        free_tile_map(&tile_map);
+    }
+    stats = get_tile_set_stats(&tile_set);
+    assert_uint_equal(stats.unique_tiles, 1);
+    assert_uint_equal(stats.flip_matches, 1);
+    assert_uint_equal(stats.bytes_out, 16);
+    assert_true(stats.dedup_ratio == 3.0);
+    free_tile_set(&tile_set);
+
+    // Flip matches are counted against the tile that was stored, whatever order the tiles arrive in
+    const struct
+    {
+        int order[3];
+        size_t flip_matches;
+    } orders[] = {
+        {{2, 0, 1}, 2},
+        {{2, 2, 2}, 0},
+        {{0, 2, 2}, 2}};
+    for (int o = 0; o < 3; o++)
+    {
+        tile_set = create_tile_set(1);
+        for (int i = 0; i < 3; i++)
+        {
+            struct tile_map_t tile_map = add_sprite_to_tile_set(&tile_set, &sprites[orders[o].order[i]]);
+            free_tile_map(&tile_map);
+        }
+        stats = get_tile_set_stats(&tile_set);
+        assert_uint_equal(stats.unique_tiles, 1);
+        assert_uint_equal(stats.flip_matches, orders[o].flip_matches);
+        free_tile_set(&tile_set);
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        free_sprite(&sprites[i]);
+    }
+
+    // A sprite that doesn't fit leaves the set as it was before that sprite
+    struct sprite_t sprite = { .width = TEST_FRAME_TILES, .height = TEST_FRAME_TILES };
+    sprite.image = calloc(TEST_BUFFER_SIZE, sizeof(uint16_t));
+    tile_set = create_tile_set(0);
+    uint32_t tile_number = 1;
+    size_t unique_tiles = 0;
+    for (;;)
+    {
+        for (int t = 0; t < TEST_FRAME_TILES * TEST_FRAME_TILES; t++)
+        {
+            sprite.image[(t % TEST_FRAME_TILES) * TEST_FRAME_HEIGHT + (t / TEST_FRAME_TILES) * TEST_TILE_ROWS] = tile_number & 0xffff;
+            sprite.image[(t % TEST_FRAME_TILES) * TEST_FRAME_HEIGHT + (t / TEST_FRAME_TILES) * TEST_TILE_ROWS + 1] = tile_number >> 16;
+            tile_number++;
+        }
+        struct tile_map_t tile_map = add_sprite_to_tile_set(&tile_set, &sprite);
+        if (tile_map.indices == NULL)
+        {
+            break;
+        }
+        unique_tiles += TEST_FRAME_TILES * TEST_FRAME_TILES;
+        free_tile_map(&tile_map);
+    }
+    stats = get_tile_set_stats(&tile_set);
+    assert_uint_equal(stats.unique_tiles, unique_tiles);
+    assert_uint_equal(stats.tiles_added, unique_tiles);
+
+    // Tiles stored before the failure are still found
+    for (int t = 0; t < TEST_FRAME_TILES * TEST_FRAME_TILES; t++)
+    {
+        sprite.image[(t % TEST_FRAME_TILES) * TEST_FRAME_HEIGHT + (t / TEST_FRAME_TILES) * TEST_TILE_ROWS] = (t + 1) & 0xffff;
+        sprite.image[(t % TEST_FRAME_TILES) * TEST_FRAME_HEIGHT + (t / TEST_FRAME_TILES) * TEST_TILE_ROWS + 1] = 0;
+    }
+    struct tile_map_t tile_map = add_sprite_to_tile_set(&tile_set, &sprite);
+    assert_non_null(tile_map.indices);
+    assert_uint_equal(tile_map.indices[48], 48);
+    free_tile_map(&tile_map);
+    stats = get_tile_set_stats(&tile_set);
+    assert_uint_equal(stats.unique_tiles, unique_tiles);
+    free_tile_set(&tile_set);
+
+    sprite.width = 0;
+    tile_set = create_tile_set(0);
+    assert_null(add_sprite_to_tile_set(&tile_set, &sprite).indices);
+    sprite.width = 8;
+    assert_null(add_sprite_to_tile_set(&tile_set, &sprite).indices);
+    assert_uint_equal(get_tile_set_stats(&tile_set).tiles_added, 0);
+    free_tile_set(&tile_set);
+    free_sprite(&sprite);
+}
+
+static void tile_map_round_trip(void **state)
+{
+    (void)state;
+    struct sprite_t sprites[2] = {test_sprite(), flipped_test_sprite()};
+    struct tile_set_t tile_set = create_tile_set(1);
+    for (int i = 0; i < 2; i++)
+    {
+        struct tile_map_t tile_map = add_sprite_to_tile_set(&tile_set, &sprites[i]);
+        struct sprite_t sprite = tile_map_to_sprite(&tile_set, &tile_map);
+        assert_int_equal(sprite.width, sprites[i].width);
+        assert_int_equal(sprite.height, sprites[i].height);
+        assert_memory_equal(sprite.image, sprites[i].image, TEST_BUFFER_SIZE * sizeof(uint16_t));
+        free_sprite(&sprite);
+        free_tile_map(&tile_map);
+        free_sprite(&sprites[i]);
+    }
+
+    // Maps that don't belong to the tile set give an empty sprite
+    uint16_t indices[2] = {0, 1};
+    uint8_t attributes[2] = {0, 0};
+    struct tile_map_t tile_map = { .width = 1, .height = 1, .indices = indices + 1, .attributes = attributes };
+    assert_null(tile_map_to_sprite(&tile_set, &tile_map).image);
+    tile_map.indices = indices;
+    tile_map.width = 8;
+    assert_null(tile_map_to_sprite(&tile_set, &tile_map).image);
+    tile_map.width = 0;
+    assert_null(tile_map_to_sprite(&tile_set, &tile_map).image);
+    free_tile_set(&tile_set);
+}
+
+void check_sprite_query(const char *const filename)
+{
+    struct sprite_t sprite = load_sprite(filename);
+    struct sprite_query_t expected = scan_sprite(&sprite);
+    struct sprite_query_t query = query_sprite(filename);
+
+    assert_int_equal(query.width, expected.width);
+    assert_int_equal(query.height, expected.height);
+    assert_int_equal(query.bounds_x, expected.bounds_x);
+    assert_int_equal(query.bounds_y, expected.bounds_y);
+    assert_int_equal(query.bounds_width, expected.bounds_width);
+    assert_int_equal(query.bounds_height, expected.bounds_height);
+    assert_uint_equal(query.occupied_columns, expected.occupied_columns);
+    assert_memory_equal(query.histogram, expected.histogram, sizeof(query.histogram));
+
+    for (uint8_t column = 0; column <= sprite.width * 8; column++)
+    {
+        uint8_t expected_empty = (column >= sprite.width * 8) || !((expected.occupied_columns >> column) & 0x01);
+        uint8_t empty;
+        assert_int_equal(is_sprite_column_empty(filename, column, &empty), 1);
+        assert_int_equal(empty, expected_empty);
+    }
+
+    size_t size;
+    uint8_t *data = read_test_file_data(filename, &size);
+    query = query_sprite_data(data, size);
+    assert_int_equal(query.bounds_x, expected.bounds_x);
+    assert_int_equal(query.bounds_width, expected.bounds_width);
+    assert_uint_equal(query.occupied_columns, expected.occupied_columns);
+    assert_memory_equal(query.histogram, expected.histogram, sizeof(query.histogram));
+    for (uint8_t column_count = 0; column_count <= sprite.width * 8; column_count++)
+    {
+        uint64_t column_mask = ((uint64_t)1 << column_count) - 1;
+        uint64_t occupied_columns;
+        assert_int_equal(get_occupied_columns_data(data, size, column_count, &occupied_columns), 1);
+        assert_uint_equal(occupied_columns, expected.occupied_columns & column_mask);
+        if (column_count < sprite.width * 8)
+        {
+            uint8_t expected_empty = !((expected.occupied_columns >> column_count) & 0x01);
+            uint8_t empty;
+            assert_int_equal(is_sprite_column_empty_data(data, size, column_count, &empty), 1);
+            assert_int_equal(empty, expected_empty);
+        }
+    }
+    uint64_t occupied_columns;
+    assert_int_equal(get_occupied_columns(filename, 64, &occupied_columns), 1);
+    assert_uint_equal(occupied_columns, expected.occupied_columns);
+    free(data);
+    free_sprite(&sprite);
+}
+
+void check_sprite_planes(const char *const filename)
+{
+    struct sprite_t sprite = load_sprite(filename);
+    size_t offset = sprite_frame_offset(&sprite);
+    size_t image_size = sprite.width * sprite.height * TEST_TILE_ROWS;
+    const enum sprite_plane_t planes[] = {SPRITE_PLANE_MASK, SPRITE_PLANE_LOW, SPRITE_PLANE_HIGH};
+    size_t size;
+    uint8_t *data = read_test_file_data(filename, &size);
+
+    for (int p = 0; p < 3; p++)
+    {
+        struct sprite_mask_t mask = load_sprite_plane(filename, planes[p]);
+        assert_non_null(mask.data);
+        assert_int_equal(mask.width, sprite.width);
+        assert_int_equal(mask.height, sprite.height);
+
+        for (size_t i = 0; i < image_size; i++)
+        {
+            size_t x = i / (sprite.height * TEST_TILE_ROWS);
+            size_t y = i % (sprite.height * TEST_TILE_ROWS);
+            uint16_t pixels = sprite.image[offset + x * TEST_FRAME_HEIGHT + y];
+            uint8_t expected = 0;
+            for (int px = 0; px < 8; px++)
+            {
+                uint8_t colour = (pixels >> (14 - (px << 1))) & 0x03;
+                uint8_t bit = (planes[p] == SPRITE_PLANE_MASK) ? colour != 0 : (colour >> (planes[p] - SPRITE_PLANE_LOW)) & 0x01;
+                expected |= bit << (7 - px);
+            }
+            assert_int_equal(mask.data[i], expected);
+        }
+
+        struct sprite_mask_t data_mask = decode_sprite_plane_data(data, size, planes[p]);
+        assert_int_equal(data_mask.width, mask.width);
+        assert_int_equal(data_mask.height, mask.height);
+        assert_memory_equal(data_mask.data, mask.data, image_size);
+        free_sprite_mask(&data_mask);
+        free_sprite_mask(&mask);
+        assert_null(mask.data);
+    }
+    assert_null(decode_sprite_plane_data(data, size / 2, SPRITE_PLANE_MASK).data);
+    free(data);
+    free_sprite(&sprite);
+}
+
+static void plane_decoding(void **state)
+{
+    (void)state;
+    for (int i = 0; i < 6; i++)
+    {
+        check_sprite_planes(*compressed_source_files[i]);
+    }
+
+    struct sprite_t sprite = test_3x2_sprite(0x22);
+    for (int i = 0; i < TEST_3X2_VARIANTS; i++)
+    {
+        save_test_3x2_variant(&sprite, i, "plane.bin");
+        check_sprite_planes("plane.bin");
+    }
+    free_sprite(&sprite);
+}
+
+static void compressed_queries(void **state)
+{
+    (void)state;
+    for (int i = 0; i < 6; i++)
+    {
+        check_sprite_query(*compressed_source_files[i]);
+    }
+
+    // 3x2 sprite with a single tile set, leaving empty tiles around it
+    struct sprite_t sprite = test_3x2_sprite(0x02);
+    for (int i = 0; i < TEST_3X2_VARIANTS; i++)
+    {
+        save_test_3x2_variant(&sprite, i, "query.bin");
+        check_sprite_query("query.bin");
+    }
+    free_sprite(&sprite);
+
+    struct sprite_query_t query = query_sprite("query.bin");
+    assert_int_equal(query.bounds_x, 8);
+    assert_int_equal(query.bounds_y, 0);
+    assert_int_equal(query.bounds_width, 8);
+    assert_int_equal(query.bounds_height, 8);
+
+    // Missing files and broken streams are errors, not empty sprites
+    const uint8_t invalid_data[2] = {0x00, 0x00};
+    size_t size;
+    uint8_t *data = read_test_file_data(b1, &size);
+    uint64_t occupied_columns;
+    uint8_t empty;
+    assert_int_equal(get_occupied_columns("missing.bin", 64, &occupied_columns), 0);
+    assert_int_equal(is_sprite_column_empty("missing.bin", 0, &empty), 0);
+    assert_int_equal(empty, 0);
+    assert_int_equal(get_occupied_columns_data(invalid_data, sizeof(invalid_data), 64, &occupied_columns), 0);
+    assert_uint_equal(occupied_columns, 0);
+    assert_int_equal(is_sprite_column_empty_data(invalid_data, sizeof(invalid_data), 0, &empty), 0);
+    assert_int_equal(get_occupied_columns_data(data, size / 2, 64, &occupied_columns), 0);
+    assert_int_equal(is_sprite_column_empty_data(data, size / 2, 63, &empty), 0);
+    assert_int_equal(is_sprite_column_empty_data(data, size, 63, &empty), 1);
+    assert_int_equal(empty, 1);
+    free(data);
+}
+
+static void set_batch_isa_limit(const char *const isa)
+{
+#if defined(_WIN32)
+    _putenv_s("GB_SPRITE_BATCH_ISA", isa);
+#else
+    setenv("GB_SPRITE_BATCH_ISA", isa, 1);
+#endif
+}
+
+static void check_batch_decoding(void)
+{
+    const char *const source_files[7] = {"../../test/test_images/test_1x1_01.bin", b1, b2, b3, c1, c2, c3};
+    const uint8_t invalid_data[2] = {0x00, 0x00};
+    const uint8_t *data[19];
+    size_t sizes[19];
+    struct sprite_t sprites[19];
+
+    for (int i = 0; i < 19; i++)
+    {
+        if (i % 7 == 6 && i > 6)
+        {
+            data[i] = invalid_data;
+            sizes[i] = sizeof(invalid_data);
+        }
+        else
+        {
+            data[i] = read_test_file_data(source_files[i % 7], &sizes[i]);
+        }
+    }
+
+    decode_sprite_batch(data, sizes, 19, sprites);
+
+    for (int i = 0; i < 19; i++)
+    {
+        if (data[i] == invalid_data)
+        {
+            assert_null(sprites[i].image);
+            assert_int_equal(sprites[i].width, 0);
+            continue;
+        }
+        struct sprite_t expected = load_sprite(source_files[i % 7]);
+        assert_non_null(sprites[i].image);
+        assert_int_equal(sprites[i].width, expected.width);
+        assert_int_equal(sprites[i].height, expected.height);
+        assert_int_equal(sprites[i].primary_buffer, expected.primary_buffer);
+        assert_int_equal(sprites[i].encoding_method, expected.encoding_method);
+        assert_memory_equal(sprites[i].image, expected.image, TEST_BUFFER_SIZE * sizeof(uint16_t));
+        free_sprite(&expected);
+        free_sprite(&sprites[i]);
+        free((uint8_t *)data[i]);
+    }
+
+    // Larger sprites in each encoding method, mixed with 1x1 sprites in the same batch
+    struct sprite_t sprite = test_3x2_sprite(0x21);
+    const char *const saved_files[TEST_3X2_VARIANTS] = {"batch_0.bin", "batch_1.bin", "batch_2.bin", "batch_3.bin", "batch_4.bin", "batch_5.bin"};
+    for (int i = 0; i < TEST_3X2_VARIANTS; i++)
+    {
+        save_test_3x2_variant(&sprite, i, saved_files[i]);
+        data[i] = read_test_file_data(saved_files[i], &sizes[i]);
+        data[i + TEST_3X2_VARIANTS] = read_test_file_data(b1, &sizes[i + TEST_3X2_VARIANTS]);
+    }
+    free_sprite(&sprite);
+
+    // A truncated stream fails in its own lane without affecting the others
+    const int truncated = 2 * TEST_3X2_VARIANTS;
+    data[truncated] = data[0];
+    sizes[truncated] = sizes[0] / 2;
+    assert_null(decode_sprite(data[truncated], sizes[truncated]).image);
+
+    decode_sprite_batch(data, sizes, truncated + 1, sprites);
+    assert_null(sprites[truncated].image);
+
+    for (int i = 0; i < truncated; i++)
+    {
+        struct sprite_t expected = load_sprite((i < TEST_3X2_VARIANTS) ? saved_files[i] : b1);
+        assert_int_equal(sprites[i].width, expected.width);
+        assert_int_equal(sprites[i].height, expected.height);
+        assert_memory_equal(sprites[i].image, expected.image, TEST_BUFFER_SIZE * sizeof(uint16_t));
+        free_sprite(&expected);
+        free_sprite(&sprites[i]);
+        free((uint8_t *)data[i]);
+    }
+}
+
+static void batch_decoding(void **state)
+{
+    (void)state;
+    // Each cap falls back to the best kernel the host supports, so every available kernel gets run
+    const char *const isa_limits[3] = {"avx512", "avx2", "scalar"};
+    for (int i = 0; i < 3; i++)
+    {
+        set_batch_isa_limit(isa_limits[i]);
+        check_batch_decoding();
+    }
+    set_batch_isa_limit("");
+}
+
 int main()
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(read_test_file),
         cmocka_unit_test(decoding),
         cmocka_unit_test(encoding),
+        cmocka_unit_test(tile_deduplication),
+        cmocka_unit_test(tile_map_round_trip),
+        cmocka_unit_test(compressed_queries),
+        cmocka_unit_test(plane_decoding),
+        cmocka_unit_test(batch_decoding),
         cmocka_unit_test(free_sprite_resources)};
 
     return cmocka_run_group_tests(tests, NULL, NULL);